@@ -0,0 +1,185 @@
+// Build tool: compress a JOS kernel ELF for boot/zboot.c.
+//
+//	lz4pack kernel kernel.lz4 limit
+//
+// Lays out the kernel's PT_LOAD segments at their physical addresses
+// exactly as boot/main.c would, and writes that memory image as a
+// struct ZHeader followed by one LZ4 block.  Fails if the image would
+// reach 'limit', the physical address the zboot stage is loaded at.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <inc/elf.h>
+#include <boot/zboot.h>
+
+#define HASH_BITS	16
+#define MIN_MATCH	4
+#define MAX_OFFSET	65535
+#define LAST_LITERALS	5	// LZ4: the block ends with >= 5 literals
+#define MFLIMIT		12	// LZ4: no match starts in the last 12 bytes
+
+static void
+die(const char *msg, const char *arg)
+{
+	fprintf(stderr, "lz4pack: %s%s%s\n", msg, arg ? ": " : "", arg ? arg : "");
+	exit(1);
+}
+
+static uint8_t *
+read_file(const char *path, size_t *size)
+{
+	FILE *f;
+	uint8_t *buf;
+	long n;
+
+	if (!(f = fopen(path, "rb")))
+		die("cannot open", path);
+	fseek(f, 0, SEEK_END);
+	n = ftell(f);
+	rewind(f);
+	if (!(buf = malloc(n)) || fread(buf, 1, n, f) != (size_t) n)
+		die("cannot read", path);
+	fclose(f);
+	*size = n;
+	return buf;
+}
+
+static uint8_t *
+put_length(uint8_t *out, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*out++ = 255;
+	*out++ = len;
+	return out;
+}
+
+// Emit one sequence: 'nlit' literals from 'lit', then (if mlen != 0)
+// a match of 'mlen' bytes 'off' bytes back.
+static uint8_t *
+put_sequence(uint8_t *out, const uint8_t *lit, size_t nlit,
+	     size_t off, size_t mlen)
+{
+	uint8_t *token = out++;
+
+	*token = (nlit < 15 ? nlit : 15) << 4;
+	if (nlit >= 15)
+		out = put_length(out, nlit - 15);
+	memcpy(out, lit, nlit);
+	out += nlit;
+	if (mlen) {
+		*out++ = off;
+		*out++ = off >> 8;
+		mlen -= MIN_MATCH;
+		*token |= mlen < 15 ? mlen : 15;
+		if (mlen >= 15)
+			out = put_length(out, mlen - 15);
+	}
+	return out;
+}
+
+static uint32_t
+hash4(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Greedy single-pass LZ4 block compressor.  'out' must hold at least
+// n + n/255 + 16 bytes.  Returns the compressed size.
+static size_t
+lz4_compress(const uint8_t *in, size_t n, uint8_t *out)
+{
+	static uint32_t table[1 << HASH_BITS];
+	const uint8_t *ip = in, *anchor = in, *ref;
+	const uint8_t *mflimit = n > MFLIMIT ? in + n - MFLIMIT : in;
+	const uint8_t *matchlimit = n > LAST_LITERALS ? in + n - LAST_LITERALS : in;
+	uint8_t *op = out;
+	size_t mlen;
+	uint32_t h;
+
+	memset(table, 0, sizeof(table));
+	while (ip < mflimit) {
+		h = hash4(ip);
+		ref = in + table[h];
+		table[h] = ip - in;
+		if (ref >= ip || ip - ref > MAX_OFFSET || memcmp(ref, ip, 4) != 0) {
+			ip++;
+			continue;
+		}
+		for (mlen = MIN_MATCH; ip + mlen < matchlimit
+			     && ref[mlen] == ip[mlen]; mlen++)
+			/* extend */;
+		op = put_sequence(op, anchor, ip - anchor, ip - ref, mlen);
+		ip += mlen;
+		anchor = ip;
+	}
+	return put_sequence(op, anchor, in + n - anchor, 0, 0) - out;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct ZHeader zh;
+	struct Elf *elf;
+	struct Proghdr *ph, *eph;
+	uint8_t *kernel, *image, *zdata;
+	size_t size;
+	uint32_t lo = UINT32_MAX, hi = 0, memhi = 0, limit;
+	FILE *f;
+
+	if (argc != 4)
+		die("usage: lz4pack kernel kernel.lz4 limit", NULL);
+	kernel = read_file(argv[1], &size);
+	limit = strtoul(argv[3], NULL, 0);
+
+	elf = (struct Elf *) kernel;
+	if (size < sizeof(*elf) || elf->e_magic != ELF_MAGIC)
+		die("not an ELF file", argv[1]);
+	ph = (struct Proghdr *) (kernel + elf->e_phoff);
+	eph = ph + elf->e_phnum;
+
+	// the extent of the loaded image, by physical address
+	for (; ph < eph; ph++) {
+		if (ph->p_type != ELF_PROG_LOAD)
+			continue;
+		if (ph->p_offset + ph->p_filesz > size)
+			die("segment past end of file", argv[1]);
+		if (ph->p_pa < lo)
+			lo = ph->p_pa;
+		if (ph->p_pa + ph->p_filesz > hi)
+			hi = ph->p_pa + ph->p_filesz;
+		if (ph->p_pa + ph->p_memsz > memhi)
+			memhi = ph->p_pa + ph->p_memsz;
+	}
+	if (lo >= hi || memhi > limit)
+		die("kernel image overlaps the zboot stage", argv[1]);
+
+	if (!(image = calloc(hi - lo, 1))
+	    || !(zdata = malloc(hi - lo + (hi - lo) / 255 + 16)))
+		die("out of memory", NULL);
+	for (ph = (struct Proghdr *) (kernel + elf->e_phoff); ph < eph; ph++)
+		if (ph->p_type == ELF_PROG_LOAD)
+			memcpy(image + (ph->p_pa - lo), kernel + ph->p_offset,
+			       ph->p_filesz);
+
+	zh.zh_magic = ZBOOT_MAGIC;
+	zh.zh_entry = elf->e_entry;
+	zh.zh_pa = lo;
+	zh.zh_filesz = hi - lo;
+	zh.zh_memsz = memhi - lo;
+	zh.zh_zsize = lz4_compress(image, hi - lo, zdata);
+
+	if (!(f = fopen(argv[2], "wb"))
+	    || fwrite(&zh, sizeof(zh), 1, f) != 1
+	    || fwrite(zdata, 1, zh.zh_zsize, f) != zh.zh_zsize
+	    || fclose(f) != 0)
+		die("cannot write", argv[2]);
+	fprintf(stderr, "kernel image is %u bytes, %u compressed\n",
+		zh.zh_filesz, zh.zh_zsize);
+	return 0;
+}
@@ -32,7 +32,7 @@
 #define SECTSIZE	512
 #define ELFHDR		((struct Elf *) 0x10000) // scratch space
 
-void readsect(void*, uint32_t);
+void readsects(void*, uint32_t, uint32_t);
 void readseg(uint32_t, uint32_t, uint32_t);
 
 void
@@ -53,8 +53,9 @@ bootmain(void)
 	eph = ph + ELFHDR->e_phnum;
 	for (; ph < eph; ph++) {
 		// p_pa is the load address of this segment (as well
-		// as the physical address)
-		readseg(ph->p_pa, ph->p_memsz, ph->p_offset);
+		// as the physical address).  Only the file-backed part
+		// comes off the disk; the rest is bss, zeroed below.
+		readseg(ph->p_pa, ph->p_filesz, ph->p_offset);
 		for (i = 0; i < ph->p_memsz - ph->p_filesz; i++) {
 			*((char *) ph->p_pa + ph->p_filesz + i) = 0;
 		}
@@ -76,7 +77,7 @@ bad:
 void
 readseg(uint32_t pa, uint32_t count, uint32_t offset)
 {
-	uint32_t end_pa;
+	uint32_t end_pa, nsect;
 
 	end_pa = pa + count;
 
@@ -86,17 +87,20 @@ readseg(uint32_t pa, uint32_t count, uint32_t offset)
 	// translate from bytes to sectors, and kernel starts at sector 1
 	offset = (offset / SECTSIZE) + 1;
 
-	// If this is too slow, we could read lots of sectors at a time.
-	// We'd write more to memory than asked, but it doesn't matter --
+	// Read up to 256 sectors per command.  We may write up to a
+	// sector more to memory than asked, but it doesn't matter --
 	// we load in increasing order.
 	while (pa < end_pa) {
+		nsect = (end_pa - pa + SECTSIZE - 1) / SECTSIZE;
+		if (nsect > 256)
+			nsect = 256;
 		// Since we haven't enabled paging yet and we're using
 		// an identity segment mapping (see boot.S), we can
 		// use physical addresses directly.  This won't be the
 		// case once JOS enables the MMU.
-		readsect((uint8_t*) pa, offset);
-		pa += SECTSIZE;
-		offset++;
+		readsects((uint8_t*) pa, offset, nsect);
+		pa += nsect * SECTSIZE;
+		offset += nsect;
 	}
 }
 
@@ -108,23 +112,28 @@ waitdisk(void)
 		/* do nothing */;
 }
 
+// Read 'nsect' (1 to 256) consecutive sectors starting at sector
+// 'offset' into 'dst' with a single READ SECTORS command.
 void
-readsect(void *dst, uint32_t offset)
+readsects(void *dst, uint32_t offset, uint32_t nsect)
 {
 	// wait for disk to be ready
 	waitdisk();
 
-	outb(0x1F2, 1);		// count = 1
+	outb(0x1F2, nsect);	// count; 0 means 256
 	outb(0x1F3, offset);
 	outb(0x1F4, offset >> 8);
 	outb(0x1F5, offset >> 16);
 	outb(0x1F6, (offset >> 24) | 0xE0);
 	outb(0x1F7, 0x20);	// cmd 0x20 - read sectors
 
-	// wait for disk to be ready
-	waitdisk();
+	for (; nsect > 0; nsect--) {
+		// wait for the next sector's data
+		waitdisk();
 
-	// read a sector
-	insl(0x1F0, dst, SECTSIZE/4);
+		// read a sector
+		insl(0x1F0, dst, SECTSIZE/4);
+		dst = (uint8_t *) dst + SECTSIZE;
+	}
 }
 
@@ -0,0 +1,82 @@
+#include <inc/x86.h>
+
+#include <boot/zboot.h>
+
+/**********************************************************************
+ * Decompressing second stage for kernels built with COMPRESS_KERNEL=1.
+ *
+ * Instead of the kernel, the disk then holds this small ELF program
+ * with the LZ4-compressed kernel memory image linked into it (see
+ * boot/lz4pack.c).  The boot sector loads it like any kernel, at a
+ * physical address above the end of the real kernel, and calls
+ * zboot_main(), still with paging off and the boot stack.
+ *
+ * zboot_main() expands the kernel in place at its load address,
+ * clears its bss and jumps to its entry point, exactly as bootmain()
+ * would have done after reading the uncompressed kernel.
+ **********************************************************************/
+
+extern uint8_t _binary_obj_kern_kernel_lz4_start[];
+
+// Decode one LZ4 block of 'n' bytes at 'src' into 'dst'.
+static void
+lz4_decompress(const uint8_t *src, uint32_t n, uint8_t *dst)
+{
+	const uint8_t *end = src + n, *match;
+	uint32_t len;
+	uint8_t token;
+
+	while (src < end) {
+		token = *src++;
+
+		// literal run
+		len = token >> 4;
+		if (len == 15)
+			do
+				len += *src;
+			while (*src++ == 255);
+		while (len-- > 0)
+			*dst++ = *src++;
+
+		// the last sequence has literals only
+		if (src >= end)
+			break;
+
+		// match: 16-bit back offset, then length beyond the minimum
+		match = dst - (src[0] | (src[1] << 8));
+		src += 2;
+		len = token & 15;
+		if (len == 15)
+			do
+				len += *src;
+			while (*src++ == 255);
+		len += 4;
+		while (len-- > 0)
+			*dst++ = *match++;
+	}
+}
+
+void
+zboot_main(void)
+{
+	struct ZHeader *zh = (struct ZHeader *) _binary_obj_kern_kernel_lz4_start;
+	uint8_t *p;
+
+	if (zh->zh_magic != ZBOOT_MAGIC)
+		goto bad;
+
+	lz4_decompress((uint8_t *) (zh + 1), zh->zh_zsize,
+		       (uint8_t *) zh->zh_pa);
+	for (p = (uint8_t *) zh->zh_pa + zh->zh_filesz;
+	     p < (uint8_t *) zh->zh_pa + zh->zh_memsz; p++)
+		*p = 0;
+
+	// call the kernel's entry point; does not return!
+	((void (*)(void)) (zh->zh_entry))();
+
+bad:
+	outw(0x8A00, 0x8A00);
+	outw(0x8A00, 0x8E00);
+	while (1)
+		/* do nothing */;
+}
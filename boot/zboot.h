@@ -0,0 +1,21 @@
+#ifndef JOS_BOOT_ZBOOT_H
+#define JOS_BOOT_ZBOOT_H
+
+// Header of a compressed kernel image, as written by boot/lz4pack and
+// read by boot/zboot.c.  It is followed by a single LZ4 block that
+// decompresses to the kernel's loaded memory image: every PT_LOAD
+// segment's file contents placed at its physical address, with any
+// gaps between segments zero-filled.
+
+#define ZBOOT_MAGIC	0x345A4C4AU	/* "JLZ4" in little endian */
+
+struct ZHeader {
+	uint32_t zh_magic;	// must equal ZBOOT_MAGIC
+	uint32_t zh_entry;	// kernel entry point (physical)
+	uint32_t zh_pa;		// physical address of the memory image
+	uint32_t zh_filesz;	// bytes of decompressed memory image
+	uint32_t zh_memsz;	// bytes including the trailing bss to zero
+	uint32_t zh_zsize;	// bytes of LZ4 data following the header
+};
+
+#endif /* !JOS_BOOT_ZBOOT_H */
@@ -483,7 +483,8 @@ Failed to shutdown QEMU.  You might need to 'killall qemu' or
 # Monitors
 #
 
-__all__ += ["save", "stop_breakpoint", "call_on_line", "stop_on_line"]
+__all__ += ["save", "stop_breakpoint", "call_on_line", "stop_on_line",
+            "report_boot_time"]
 
 def save(path):
     """Return a monitor that writes QEMU's output to path.  If the
@@ -538,6 +539,16 @@ def call_on_line(regexp, callback):
         runner.qemu.on_output.append(handle_output)
     return setup_call_on_line
 
+def report_boot_time():
+    """Returns a monitor that reports, next to the test result, how
+    many TSC cycles JOS took from reset to i386_init."""
+
+    def report(line):
+        cycles = int(line.split()[4])
+        sys.stdout.write("(boot %.1fM cycles) " % (cycles / 1e6))
+        sys.stdout.flush()
+    return call_on_line(r"boot: reached i386_init after [0-9]+ cycles", report)
+
 def stop_on_line(regexp):
     """Returns a monitor that stops when QEMU prints a line matching
     'regexp'."""
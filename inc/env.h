@@ -43,28 +43,64 @@ enum EnvType {
 	ENV_TYPE_USER = 0,
 };
 
-struct Env {
-	struct Trapframe env_tf;	// Saved registers
+// Scheduling-hot per-environment state.
+// sched_yield() scans this for every slot on every reschedule, so it is
+// kept in its own dense array, envsched[], indexed in parallel with envs[]
+// (use ENVSCHED(e) to get at it), rather than next to the Trapframe in
+// struct Env.  Four entries share one 64-byte cache line.
+struct EnvSched {
 	struct Env *env_link;		// Next free Env
+	uint32_t env_runs;		// Number of times environment has run
+	uint8_t env_status;		// Status of the environment
+	uint8_t env_cpunum;		// The CPU that the env is running on
+	uint8_t env_affinity;		// CPUs the env may run on, one bit each
+	uint8_t env_sched_pad[1];
+	uint32_t env_migrations;	// Times the env moved to another CPU
+};
+
+#define ENVSCHED(e)		(&envsched[(e) - envs])
+
+// env_affinity of a new environment: any CPU
+#define ENV_AFFINITY_ALL	0xFF
+
+// Words in struct Env's env_ptmap bitmap: one bit per page directory
+// entry below UTOP.
+#define ENV_PTMAP_NWORDS	((PDX(UTOP) + 31) / 32)
+
+struct Env {
 	envid_t env_id;			// Unique environment identifier
 	envid_t env_parent_id;		// env_id of this env's parent
 	enum EnvType env_type;		// Indicates special system environments
-	unsigned env_status;		// Status of the environment
-	uint32_t env_runs;		// Number of times environment has run
-	int env_cpunum;			// The CPU that the env is running on
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
+	uint32_t env_ptmap[ENV_PTMAP_NWORDS];	// User PDEs env_pgdir has used
+	struct Image *env_image;	// Demand-paged program image, or NULL
+	struct PageInfo *env_vdso;	// Info page mapped at UVDSO + PGSIZE
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	uintptr_t env_xstacktop;	// Top of the user exception stack
+
+	// Threads
+	uint32_t *env_exit_futex;	// Word to clear and wake on exit
+
+	// CPU time, in TSC cycles
+	uint64_t env_utime;		// Running in user mode
+	uint64_t env_stime;		// In the kernel on the env's behalf
+	uint64_t env_wtime;		// Runnable, waiting for a CPU
+	uint64_t env_tstamp;		// TSC at the start of the current interval
 
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
 	void *env_ipc_dstva;		// VA at which to map received page
+	size_t env_ipc_npages;		// Most pages to receive, then received
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+
+	// Only touched when entering or leaving the environment
+	struct Trapframe env_tf;	// Saved registers
 };
 
 #endif // !JOS_INC_ENV_H
@@ -17,18 +17,49 @@
 #include <inc/memlayout.h>
 #include <inc/syscall.h>
 #include <inc/trap.h>
+#include <inc/sync.h>
+#include <inc/vdso.h>
 
 #define USED(x)		(void)(x)
 
 // main user program
 void	umain(int argc, char **argv);
 
+// Thread stacks (see lib/thread.c).  Each thread owns one THREAD_SLOT
+// sized, aligned slot at UTHREADS, laid out like the main stack: from
+// the bottom, an unmapped guard page, THREAD_STACK_PAGES of stack, an
+// unmapped page, and the thread's exception stack.  The top word of
+// the stack holds the thread's thisenv.
+#define UTHREADS		0xE0000000
+#define THREAD_MAX		64
+#define THREAD_STACK_PAGES	5
+#define THREAD_SLOT		((THREAD_STACK_PAGES + 3) * PGSIZE)
+#define THREAD_STACKTOP(slot)	((slot) + (THREAD_STACK_PAGES + 1) * PGSIZE)
+#define THREAD_XSTACKTOP(slot)	((slot) + THREAD_SLOT)
+
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
+extern const volatile struct Env *thisenv_main;
 extern const volatile struct Env envs[NENV];
+extern const volatile struct EnvSched envsched[NENV];
 extern const volatile struct PageInfo pages[];
 
+// Where this thread's thisenv lives: the main thread's is thisenv_main,
+// others keep theirs at the top of their stack slot.
+static inline const volatile struct Env **
+thread_envp(void)
+{
+	uintptr_t esp;
+
+	asm("movl %%esp,%0" : "=r" (esp));
+	if (esp - UTHREADS < THREAD_MAX * THREAD_SLOT)
+		return (const volatile struct Env **)
+			(THREAD_STACKTOP(ROUNDDOWN(esp, THREAD_SLOT)) - sizeof(void *));
+	return &thisenv_main;
+}
+
+#define thisenv		(*thread_envp())
+
 // exit.c
 void	exit(void);
 
@@ -53,6 +84,16 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_try_send_pages(envid_t to_env, uint32_t value, void *pg,
+			       size_t npages, int perm);
+int	sys_ipc_recv_pages(void *rcv_pg, size_t npages);
+int	sys_ipc_recv_timeout(void *rcv_pg, size_t npages, unsigned msec);
+int	sys_sleep(unsigned msec);
+int	sys_futex_wait(volatile uint32_t *addr, uint32_t expected);
+int	sys_futex_wake(volatile uint32_t *addr, uint32_t n);
+envid_t	sys_thread_create(void *eip, void *esp, uintptr_t xstacktop,
+			  volatile uint32_t *exit_futex);
+int	sys_env_set_affinity(envid_t env, uint32_t cpumask);
 
 // This must be inlined.  Exercise for reader: why?
 static inline envid_t __attribute__((always_inline))
@@ -68,8 +109,55 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+void	ipc_send_pages(envid_t to_env, uint32_t value, void *pg,
+		       size_t npages, int perm);
+int32_t	ipc_recv_pages(envid_t *from_env_store, void *pg, size_t *npages,
+		       int *perm_store);
+int32_t	ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+			 unsigned msec);
 envid_t	ipc_find_env(enum EnvType type);
 
+// chan.c
+struct Chan;
+int	chan_create(envid_t reader, void *va, struct Chan **chanp);
+int	chan_accept(void *va, struct Chan **chanp);
+ssize_t	chan_write(struct Chan *c, const void *buf, size_t n);
+ssize_t	chan_read(struct Chan *c, void *buf, size_t n);
+void	chan_close(struct Chan *c);
+
+// sync.c
+void	mutex_lock(struct Mutex *m);
+bool	mutex_trylock(struct Mutex *m);
+void	mutex_unlock(struct Mutex *m);
+void	cond_wait(struct Cond *c, struct Mutex *m);
+void	cond_signal(struct Cond *c);
+void	cond_broadcast(struct Cond *c);
+void	barrier_init(struct Barrier *b, uint32_t count);
+bool	barrier_wait(struct Barrier *b);
+
+// thread.c
+envid_t	thread_create(void (*fn)(void *), void *arg);
+int	thread_join(envid_t id);
+void	thread_exit(void) __attribute__((noreturn));
+
+// fiber.c
+// fiber_ipc_send sends from the worker thread running the fiber, which
+// never receives: peers must send replies to the envid of the thread
+// that called fiber_run, not to the sender of the message.
+int	fiber_create(void (*fn)(void *), void *arg);
+void	fiber_yield(void);
+void	fiber_exit(void) __attribute__((noreturn));
+int	fiber_run(int nworkers);
+int	fiber_ipc_send(envid_t to, uint32_t value);
+int32_t	fiber_ipc_recv(envid_t from);
+int32_t	fiber_ipc_accept(envid_t *from_store);
+
+// vdso.c
+envid_t	vdso_envid(void);
+int	vdso_cpunum(void);
+uint64_t vdso_time_ns(void);
+uint64_t vdso_ticks(void);
+
 // fork.c
 #define	PTE_SHARE	0x400
 envid_t	fork(void);
@@ -17,6 +17,8 @@
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
 #define GD_TSS0   0x28     // Task segment selector for CPU 0
+#define GD_KCPU0  0x68     // Per-CPU data segment for CPU 0 (after the
+			   // NCPU task segments)
 
 /*
  * Virtual memory map:                                Permissions
@@ -50,7 +52,7 @@
  *    UVPT      ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
- *                     |           RO ENVS            | R-/R-  PTSIZE
+ *                     |    RO ENVS and ENVSCHED      | R-/R-  PTSIZE
  * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebff000
@@ -70,6 +72,8 @@
  *    PFTEMP ------->  |       Empty Memory (*)       |        PTSIZE
  *                     |                              |
  *    UTEMP -------->  +------------------------------+ 0x00400000      --+
+ *                     |     RO vDSO Info Pages       | R-/R-  2*PGSIZE   |
+ *    UVDSO  ------->  +------------------------------+ 0x003fe000        |
  *                     |       Empty Memory (*)       |                   |
  *                     | - - - - - - - - - - - - - - -|                   |
  *                     |  User STAB Data (optional)   |                 PTSIZE
@@ -114,6 +118,9 @@
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// Read-only copy of the envsched[] array, in the upper half of the
+// UENVS region (struct Env's fill the lower half)
+#define UENVSCHED	(UENVS + PTSIZE / 2)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -135,6 +142,9 @@
 // Used for temporary page mappings for the user page-fault handler
 // (should not conflict with other temporary page mappings)
 #define PFTEMP		(UTEMP + PTSIZE - PGSIZE)
+// Read-only info pages the kernel maps in every environment (see
+// inc/vdso.h).  Below UTEXT, so fork() leaves them alone.
+#define UVDSO		((uintptr_t) UTEMP - 2*PGSIZE)
 // The location of the user-level STABS data structure
 #define USTABDATA	(PTSIZE / 2)
 
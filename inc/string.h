@@ -20,6 +20,16 @@ void *	memmove(void *dst, const void *src, size_t len);
 int	memcmp(const void *s1, const void *s2, size_t len);
 void *	memfind(const void *s, int c, size_t len);
 
+// Variants for special cases (lib/string.c)
+void *	memset_nt(void *dst, int c, size_t len);
+void	zero_page(void *pg);
+void	zero_page_nt(void *pg);
+void	copy_page(void *dst, const void *src);
+void	copy_page_nt(void *dst, const void *src);
+#ifndef JOS_KERNEL
+void *	memcpy_sse2(void *dst, const void *src, size_t len);
+#endif
+
 long	strtol(const char *s, char **endptr, int base);
 
 #endif /* not JOS_INC_STRING_H */
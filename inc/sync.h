@@ -0,0 +1,28 @@
+#ifndef JOS_INC_SYNC_H
+#define JOS_INC_SYNC_H
+
+#include <inc/types.h>
+
+// Blocking synchronization for environments that share memory, built
+// on sys_futex_wait/sys_futex_wake (see lib/sync.c).  All of these live
+// in ordinary memory; to synchronize several environments, put them in
+// a page the environments share, e.g. one allocated with PTE_SHARE
+// before fork.  An all-zero object is ready to use, except that a
+// barrier also needs its count set with barrier_init.
+
+struct Mutex {
+	volatile uint32_t m_state;	// 0 free, 1 held, 2 held and contended
+};
+
+struct Cond {
+	volatile uint32_t c_seq;	// bumped on every signal
+	volatile uint32_t c_waiters;	// environments in cond_wait
+};
+
+struct Barrier {
+	uint32_t b_count;		// environments to wait for
+	volatile uint32_t b_arrived;	// arrived in this round
+	volatile uint32_t b_round;	// bumped when a round completes
+};
+
+#endif	// !JOS_INC_SYNC_H
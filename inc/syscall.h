@@ -16,6 +16,11 @@ enum {
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_sleep,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_thread_create,
+	SYS_env_set_affinity,
 	NSYSCALLS
 };
 
@@ -46,6 +51,16 @@ static const char *syscall_name(int syscallno) {
             return "ipc_try_send";
         case SYS_ipc_recv:
             return "ipc_recv";
+        case SYS_sleep:
+            return "sleep";
+        case SYS_futex_wait:
+            return "futex_wait";
+        case SYS_futex_wake:
+            return "futex_wake";
+        case SYS_thread_create:
+            return "thread_create";
+        case SYS_env_set_affinity:
+            return "env_set_affinity";
         default:
             return "invalid_syscall";
     }
@@ -38,6 +38,8 @@
 #define IRQ_SPURIOUS     7
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_RESCHED     20	// reschedule IPI, sent by sched_wakeup()
+#define IRQ_CALL        21	// cross-CPU call IPI, sent by ipi_call()
 
 #ifndef __ASSEMBLER__
 
@@ -0,0 +1,28 @@
+#ifndef JOS_INC_VDSO_H
+#define JOS_INC_VDSO_H
+
+#include <inc/types.h>
+#include <inc/env.h>
+
+// Read-only pages the kernel maps into every environment at UVDSO,
+// from which user code can learn who and where it is, and what time
+// it is, without a system call (see lib/vdso.c).
+
+// At UVDSO: one page shared by every environment.
+struct VdsoTime {
+	uint32_t vt_tsc_khz;		// TSC frequency
+	uint32_t vt_tsc_ns_mult;	// ns = cycles * mult >> shift
+	uint32_t vt_tsc_ns_shift;
+	uint32_t vt_pad;
+	volatile uint64_t vt_ticks;	// Timer interrupts on the boot CPU
+};
+
+// At UVDSO + PGSIZE: one page per address space, rewritten by env_run.
+// Threads share their address space's page, so for them it describes
+// whichever thread ran last.
+struct VdsoEnv {
+	volatile envid_t ve_envid;	// Environment last run
+	volatile uint32_t ve_cpunum;	// CPU it last ran on
+};
+
+#endif	// !JOS_INC_VDSO_H
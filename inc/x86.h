@@ -171,6 +171,24 @@ rcr3(void)
 	return val;
 }
 
+static inline void
+clts(void)
+{
+	asm volatile("clts");
+}
+
+static inline void
+fxsave(void *area)
+{
+	asm volatile("fxsave %0" : "=m" (*(uint8_t (*)[512]) area));
+}
+
+static inline void
+fxrstor(const void *area)
+{
+	asm volatile("fxrstor %0" : : "m" (*(const uint8_t (*)[512]) area));
+}
+
 static inline void
 lcr4(uint32_t val)
 {
@@ -261,4 +279,18 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically store newval in *addr if it holds oldval.
+// Returns the value *addr held before.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1"
+		     : "=a" (result), "+m" (*addr)
+		     : "r" (newval), "0" (oldval)
+		     : "cc", "memory");
+	return result;
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -9,20 +9,11 @@
 #include <kern/console.h>
 #include <kern/trap.h>
 #include <kern/picirq.h>
+#include <kern/time.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
 
-// Stupid I/O delay routine necessitated by historical PC design flaws
-static void
-delay(void)
-{
-	inb(0x84);
-	inb(0x84);
-	inb(0x84);
-	inb(0x84);
-}
-
 /***** Serial I/O code *****/
 
 #define COM1		0x3F8
@@ -69,10 +60,12 @@ serial_putc(int c)
 {
 	int i;
 
+	// Wait at most 12.8ms (over 10 characters at 9600 baud) for
+	// room in the transmitter.
 	for (i = 0;
 	     !(inb(COM1 + COM_LSR) & COM_LSR_TXRDY) && i < 12800;
 	     i++)
-		delay();
+		udelay(1);
 
 	outb(COM1 + COM_TX, c);
 }
@@ -116,7 +109,7 @@ lpt_putc(int c)
 	int i;
 
 	for (i = 0; !(inb(0x378+1) & 0x80) && i < 12800; i++)
-		delay();
+		udelay(1);
 	outb(0x378+0, c);
 	outb(0x378+2, 0x08|0x04|0x01);
 	outb(0x378+2, 0x08);
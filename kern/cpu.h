@@ -19,6 +19,7 @@ enum {
 
 // Per-CPU state
 struct CpuInfo {
+	struct CpuInfo *cpu_self;       // Points to itself; read via %gs:0
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
@@ -35,12 +36,25 @@ extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
 int cpunum(void);
-#define thiscpu (&cpus[cpunum()])
+
+// This CPU's cpus[] entry.  %gs always selects this CPU's per-CPU data
+// segment in the kernel (see env_init_percpu), so this is a single
+// segment-relative load rather than cpunum()'s LAPIC MMIO read.
+static inline struct CpuInfo *
+percpu_self(void)
+{
+	struct CpuInfo *c;
+	asm volatile("movl %%gs:0,%0" : "=r" (c));
+	return c;
+}
+#define thiscpu (percpu_self())
 
 void mp_init(void);
 void lapic_init(void);
-void lapic_startap(uint8_t apicid, uint32_t addr);
+void lapic_startap_all(uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(uint8_t apicid, int vector);
+void lapic_ipi_mask(uint8_t apicmask, int vector);
 
 #endif
@@ -13,14 +13,37 @@
 #include <kern/monitor.h>
 #include <kern/sched.h>
 #include <kern/cpu.h>
+#include <kern/image.h>
 #include <kern/spinlock.h>
+#include <kern/futex.h>
+#include <kern/vdso.h>
 
 struct Env *envs = NULL;		// All environments
+struct EnvSched *envsched = NULL;	// Scheduling state, parallel to envs
+struct FpuState *envfpu = NULL;		// FPU/SSE state, parallel to envs
+struct Timer *envtimer = NULL;		// Sleep/timeout timers, parallel to envs
+static bool env_fpu_fxsr;		// CPU supports FXSAVE/FXRSTOR and SSE
 static struct Env *env_free_list;	// Free environment list
-					// (linked by Env->env_link)
+					// (linked by EnvSched->env_link)
+static struct Env *env_reclaim_list;	// Destroyed, memory not yet freed
+					// (linked by EnvSched->env_link)
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
+// Page directory template for new environments: the kernel half
+// (PDX(UTOP) and up) of kern_pgdir, captured once by env_init().
+// The kernel never adds page directory entries above UTOP after
+// mem_init(), so this stays valid for the lifetime of the system.
+static pde_t env_pgdir_template[NPDENTRIES - PDX(UTOP)];
+
+// Recycled environment page directories, linked through pp_link.
+// Each one already holds the template's kernel half, its own UVPT
+// self-mapping and an all-zero user half, so env_setup_vm() can hand
+// it out without touching the page at all.
+#define ENV_PGDIR_CACHE_MAX	32
+static struct PageInfo *env_pgdir_cache;
+static int env_pgdir_ncached;
+
 // Global descriptor table.
 //
 // Set up global descriptor table (GDT) with separate segments for
@@ -36,7 +59,7 @@ static struct Env *env_free_list;	// Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[NCPU + 5] =
+struct Segdesc gdt[2 * NCPU + 5] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -55,7 +78,11 @@ struct Segdesc gdt[NCPU + 5] =
 
 	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
 	// in trap_init_percpu()
-	[GD_TSS0 >> 3] = SEG_NULL
+	[GD_TSS0 >> 3] = SEG_NULL,
+
+	// Per-CPU data segments (starting from GD_KCPU0) are initialized
+	// in env_init_percpu()
+	[GD_KCPU0 >> 3] = SEG_NULL
 };
 
 struct Pseudodesc gdt_pd = {
@@ -89,8 +116,8 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	// (i.e., does not refer to a _previous_ environment
 	// that used the same slot in the envs[] array).
 	e = &envs[ENVX(envid)];
-	if (e->env_status == ENV_FREE || e->env_id != envid) {
-        cprintf("bad env throw: is free %d, is id not matched %d, not curenv %d\n", e->env_status == ENV_FREE, e->env_id != envid, e != curenv);
+	if (ENVSCHED(e)->env_status == ENV_FREE || e->env_id != envid) {
+        cprintf("bad env throw: is free %d, is id not matched %d, not curenv %d\n", ENVSCHED(e)->env_status == ENV_FREE, e->env_id != envid, e != curenv);
         cprintf("curenv id [%08x] this env id [%08x]\n", curenv->env_id, e->env_id);
         *env_store = 0;
 		return -E_BAD_ENV;
@@ -122,20 +149,26 @@ env_init(void)
 {
 	// Set up envs array
 	// LAB 3: Your code here.
+	// keep whole EnvSched entries inside a cache line
+	static_assert(64 % sizeof(struct EnvSched) == 0);
 	// initialize to be 0
 	memset(envs, 0, NENV * sizeof(struct Env));
+	memset(envsched, 0, NENV * sizeof(struct EnvSched));
 	// make the linked list
 	// not setting the last element, therefore default to NULL by memset
 	for (size_t i = 0; i < NENV - 1; ++i) {
-	    envs[i].env_status = ENV_FREE;
+	    envsched[i].env_status = ENV_FREE;
 	    envs[i].env_id = 0;
-	    envs[i].env_link = &envs[i + 1];
+	    envsched[i].env_link = &envs[i + 1];
 	}
-	envs[NENV - 1].env_link = NULL;
+	envsched[NENV - 1].env_link = NULL;
 	// set linked list head
 	env_free_list = envs;
 	// free list setup done
 
+	// Capture the kernel half of every environment's page directory
+	memcpy(env_pgdir_template, &kern_pgdir[PDX(UTOP)], sizeof(env_pgdir_template));
+
 	// Per-CPU part of the initialization
 	env_init_percpu();
 }
@@ -144,11 +177,33 @@ env_init(void)
 void
 env_init_percpu(void)
 {
+	int i = cpunum();
+
+	static_assert(GD_KCPU0 == GD_TSS0 + (NCPU << 3));
+	static_assert(offsetof(struct CpuInfo, cpu_self) == 0);
+
+	// GS selects a segment spanning just this CPU's cpus[] entry, so
+	// thiscpu is one load from %gs:0 (see kern/cpu.h).  Returning to
+	// user mode nulls GS, since the segment's DPL is 0; _alltraps
+	// reloads it.
+	cpus[i].cpu_self = &cpus[i];
+	gdt[(GD_KCPU0 >> 3) + i] = SEG16(STA_W, (uint32_t) &cpus[i],
+					 sizeof(struct CpuInfo) - 1, 0);
 	lgdt(&gdt_pd);
-	// The kernel never uses GS or FS, so we leave those set to
-	// the user data segment.
-	asm volatile("movw %%ax,%%gs" : : "a" (GD_UD|3));
+	asm volatile("movw %%ax,%%gs" : : "a" (GD_KCPU0 + (i << 3)));
+	// The kernel never uses FS, so we leave it set to the user data
+	// segment.
 	asm volatile("movw %%ax,%%fs" : : "a" (GD_UD|3));
+	// User environments may use the FPU and SSE; the kernel never
+	// does.  CR0.TS starts set so that each CPU loads an env's FPU
+	// state only when the env first touches it (see env_fpu_trap).
+	uint32_t edx;
+	cpuid(1, NULL, NULL, NULL, &edx);
+	env_fpu_fxsr = (edx & (1 << 24)) != 0;	// CPUID.01H:EDX.FXSR
+	lcr0((rcr0() & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS);
+	if (env_fpu_fxsr)
+		lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+
 	// The kernel does use ES, DS, and SS.  We'll change between
 	// the kernel and user data segments as needed.
 	asm volatile("movw %%ax,%%es" : : "a" (GD_KD));
@@ -174,65 +229,205 @@ env_init_percpu(void)
 static int
 env_setup_vm(struct Env *e)
 {
-	int i;
-	struct PageInfo *p = NULL;
+	struct PageInfo *p;
+	pde_t *pgdir;
+
+	memset(e->env_ptmap, 0, sizeof(e->env_ptmap));
+
+	// Reuse a ready-made page directory if we have one.
+	if ((p = env_pgdir_cache) != NULL) {
+		env_pgdir_cache = p->pp_link;
+		env_pgdir_ncached--;
+		p->pp_link = NULL;
+		p->pp_ref++;
+		e->env_pgdir = page2kva(p);
+		return 0;
+	}
 
-	// Allocate a page for the page directory
-	if (!(p = page_alloc(ALLOC_ZERO)))
+	// Otherwise build one: empty user half, template kernel half.
+	if (!(p = page_alloc(0)))
 		return -E_NO_MEM;
+	// In general, pp_ref is not maintained for physical pages mapped
+	// only above UTOP, but env_pgdir is an exception -- env_free
+	// relies on it.
+	p->pp_ref++;
+	pgdir = page2kva(p);
+	memset(pgdir, 0, PDX(UTOP) * sizeof(pde_t));
+	memcpy(&pgdir[PDX(UTOP)], env_pgdir_template, sizeof(env_pgdir_template));
 
-	// Now, set e->env_pgdir and initialize the page directory.
-	//
-	// Hint:
-	//    - The VA space of all envs is identical above UTOP
-	//	(except at UVPT, which we've set below).
-	//	See inc/memlayout.h for permissions and layout.
-	//	Can you use kern_pgdir as a template?  Hint: Yes.
-	//	(Make sure you got the permissions right in Lab 2.)
-	//    - The initial VA below UTOP is empty.
-	//    - You do not need to make any more calls to page_alloc.
-	//    - Note: In general, pp_ref is not maintained for
-	//	physical pages mapped only above UTOP, but env_pgdir
-	//	is an exception -- you need to increment env_pgdir's
-	//	pp_ref for env_free to work correctly.
-	//    - The functions in kern/pmap.h are handy.
-
-	// LAB 3: Your code here.
-    // memset(page2kva(p), 0, PGSIZE);   // no need to zero the page
-    // use kernel page as template
-    // can conveniently replace some of the entries, for the pages are marked not referenced
-    pde_t *upgdir = page2kva(p);
-    memcpy(upgdir, kern_pgdir, PGSIZE);
-    // must increment env_pgdir's reference count according to Hint
-    p->pp_ref++;
-    // setup Env structure
-    e->env_pgdir = upgdir;
-    // set page directory entries to user accessible
-//    for (pde_t *pde = upgdir; pde < (pde_t*)((uintptr_t)upgdir + PGSIZE); ++pde) {
-//        // cprintf("pde at %u user permission %u\n", pde - e->env_pgdir, *pde & PTE_U);
-//        *pde |= PTE_U | PTE_W;
-//    }
-    /*for (pde_t *pde = upgdir; pde < (pde_t*)((uintptr_t)upgdir + PGSIZE); ++pde) {
-        cprintf("pde at %u user permission %u\n", pde - e->env_pgdir, *pde & PTE_U);
-    }*/
-    /*
-    // insert mappings below UTOP
-    // user exception stack
-    page_insert(page2kva(p), pa2page(UTOP - PGSIZE), UTOP - PGSIZE, PTE_U | PTE_W);
-    pa2page(UTOP - PGSIZE)->pp_ref++;
-    // preserved empty memory just above USTACKTOP
-    // normal user stack
-    for (void *pa = UTEXT; pa < USTACKTOP; pa += PGSIZE) {
-        page_insert(page2kva(p), pa2page(pa), pa, PTE_U | PTE_W);
-        // must increment reference count for mappings below UTOP
-        pa2page(pa)->pp_ref++;
-    }
-
-    */
 	// UVPT maps the env's own page table read-only.
 	// Permissions: kernel R, user R
-	e->env_pgdir[PDX(UVPT)] = PADDR(e->env_pgdir) | PTE_P | PTE_U;
+	pgdir[PDX(UVPT)] = PADDR(pgdir) | PTE_P | PTE_U;
+
+	e->env_pgdir = pgdir;
+	return 0;
+}
+
+// Unmap every page in the user portion of e's address space and free
+// its page tables.  Only the page tables recorded in env_ptmap can be
+// present.  The caller must make sure no CPU is using the mappings.
+static void
+env_unmap_user(struct Env *e)
+{
+	pte_t *pt;
+	uint32_t i, pdeno, pteno;
+	physaddr_t pa;
+
+	static_assert(UTOP % PTSIZE == 0);
+	for (i = 0; i < ENV_PTMAP_NWORDS; i++) {
+		while (e->env_ptmap[i]) {
+			pdeno = i * 32 + __builtin_ctz(e->env_ptmap[i]);
+			e->env_ptmap[i] &= e->env_ptmap[i] - 1;
+
+			// only look at mapped page tables
+			if (!(e->env_pgdir[pdeno] & PTE_P))
+				continue;
+
+			// find the pa and va of the page table
+			pa = PTE_ADDR(e->env_pgdir[pdeno]);
+			pt = (pte_t*) KADDR(pa);
+
+			// drop the reference held by every present PTE; the
+			// table is freed below and re-zeroed when allocated
+			for (pteno = 0; pteno <= PTX(~0); pteno++) {
+				if (pt[pteno] & PTE_P)
+					page_decref(pa2page(PTE_ADDR(pt[pteno])));
+			}
+
+			// free the page table itself
+			e->env_pgdir[pdeno] = 0;
+			page_decref(pa2page(pa));
+		}
+	}
+}
+
+// Release e's reference to its page directory.  The caller must already
+// have cleared every user PDE.  If this was the last reference, the page
+// goes back to env_pgdir_cache, still initialized, unless the cache is full.
+static void
+env_put_vm(struct Env *e)
+{
+	struct PageInfo *p = pa2page(PADDR(e->env_pgdir));
+
+	e->env_pgdir = 0;
+	if (--p->pp_ref > 0)
+		return;
+	if (env_pgdir_ncached < ENV_PGDIR_CACHE_MAX) {
+		p->pp_link = env_pgdir_cache;
+		env_pgdir_cache = p;
+		env_pgdir_ncached++;
+	} else
+		page_free(p);
+}
+
+//
+// Frees every page directory in env_pgdir_cache.
+// Called by page_alloc() when it runs out, after env_reclaim().
+// Returns the number of pages freed.
+//
+int
+env_pgdir_flush(void)
+{
+	struct PageInfo *p;
+	int n;
+
+	for (n = 0; (p = env_pgdir_cache) != NULL; n++) {
+		env_pgdir_cache = p->pp_link;
+		p->pp_link = NULL;
+		page_free(p);
+	}
+	env_pgdir_ncached = 0;
+	return n;
+}
+
+//
+// Map the physical page 'pp' at 'va' in e's address space, like
+// page_insert(), and record in e->env_ptmap that the page table
+// covering 'va' is in use.  All user mappings must be made through
+// this function so that env_free() knows which PDEs to tear down.
+// 'va' must be below UTOP.
+//
+// RETURNS: as page_insert().
+//
+int
+env_page_insert(struct Env *e, struct PageInfo *pp, void *va, int perm)
+{
+	int r;
 
+	assert((uintptr_t) va < UTOP);
+	if ((r = page_insert(e->env_pgdir, pp, va, perm)) < 0)
+		return r;
+	e->env_ptmap[PDX(va) / 32] |= 1 << (PDX(va) % 32);
+	return 0;
+}
+
+// Returns the PTE for va in pgdir, given the PTE returned for the page
+// before it (or NULL): within one page table the PTEs are consecutive,
+// so pgdir_walk is only needed once per page table.
+static pte_t *
+env_range_pte(pde_t *pgdir, uintptr_t va, pte_t *prev, int create)
+{
+	if (prev && PTX(va) != 0)
+		return prev + 1;
+	return pgdir_walk(pgdir, (void *) va, create);
+}
+
+//
+// Map the npages pages mapped at srcva in srcpgdir at dstva in e's
+// address space with permissions perm, like npages calls to
+// env_page_insert() but walking each page table only once.
+// The whole range is validated, and every page table e needs is
+// allocated, before any mapping changes, so on error e's mappings
+// are untouched.  Both ranges must be page aligned and below UTOP.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL if a source page is unmapped, or perm has PTE_W but a
+//	source page is read-only
+//   -E_NO_MEM if a page table couldn't be allocated
+//
+int
+env_page_map_range(struct Env *e, void *dstva, pde_t *srcpgdir, void *srcva,
+		   size_t npages, int perm)
+{
+	uintptr_t sva, dva, send = (uintptr_t) srcva + npages * PGSIZE;
+	pte_t *spte, *dpte, old;
+	struct PageInfo *pp;
+
+	assert(send <= UTOP && (uintptr_t) dstva + npages * PGSIZE <= UTOP);
+
+	spte = NULL;
+	for (sva = (uintptr_t) srcva; sva < send; sva += PGSIZE) {
+		spte = env_range_pte(srcpgdir, sva, spte, 0);
+		if (!spte || !(*spte & PTE_P)
+		    || ((perm & PTE_W) && !(*spte & PTE_W)))
+			return -E_INVAL;
+	}
+
+	for (dva = (uintptr_t) dstva; dva < (uintptr_t) dstva + npages * PGSIZE;
+	     dva = ROUNDDOWN(dva, PTSIZE) + PTSIZE) {
+		if (!pgdir_walk(e->env_pgdir, (void *) dva, 1))
+			return -E_NO_MEM;
+		e->env_ptmap[PDX(dva) / 32] |= 1 << (PDX(dva) % 32);
+	}
+
+	spte = dpte = NULL;
+	for (sva = (uintptr_t) srcva, dva = (uintptr_t) dstva; sva < send;
+	     sva += PGSIZE, dva += PGSIZE) {
+		spte = env_range_pte(srcpgdir, sva, spte, 0);
+		dpte = env_range_pte(e->env_pgdir, dva, dpte, 0);
+		pp = pa2page(PTE_ADDR(*spte));
+		// take the new reference first in case it is the same page
+		pp->pp_ref++;
+		// write the PTE, then invalidate, then drop the old page, so
+		// no CPU sharing the page directory keeps a stale entry
+		old = *dpte;
+		*dpte = page2pa(pp) | perm | PTE_P;
+		if (old & PTE_P) {
+			tlb_invalidate(e->env_pgdir, (void *) dva);
+			page_decref(pa2page(PTE_ADDR(old)));
+		}
+	}
 	return 0;
 }
 
@@ -251,12 +446,21 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
+	if (!env_free_list)
+		env_reclaim(ENV_RECLAIM_BATCH);
 	if (!(e = env_free_list))
 		return -E_NO_FREE_ENV;
 
-	// Allocate and set up the page directory for this environment.
+	// Allocate and set up the page directory for this environment,
+	// with the info pages at UVDSO.
 	if ((r = env_setup_vm(e)) < 0)
 		return r;
+	if ((r = vdso_map(e)) < 0) {
+		env_unmap_user(e);
+		vdso_release(e);
+		env_put_vm(e);
+		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -267,8 +471,12 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
-	e->env_runs = 0;
+	ENVSCHED(e)->env_status = ENV_RUNNABLE;
+	ENVSCHED(e)->env_runs = 0;
+	ENVSCHED(e)->env_migrations = 0;
+	ENVSCHED(e)->env_affinity = ENV_AFFINITY_ALL;
+	e->env_utime = e->env_stime = e->env_wtime = 0;
+	env_account(e, NULL);
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -295,20 +503,59 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// LAB 4: Your code here.
 	e->env_tf.tf_eflags |= FL_IF;
 
+	// Start with the FPU state FNINIT would leave: every exception
+	// masked, x87 round-to-nearest extended precision, empty stack.
+	memset(ENVFPU(e), 0, sizeof(struct FpuState));
+	*(uint16_t *) &ENVFPU(e)->fs_fxsave[0] = 0x037F;	// FCW
+	*(uint32_t *) &ENVFPU(e)->fs_fxsave[24] = 0x1F80;	// MXCSR
+
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_xstacktop = UXSTACKTOP;
+	e->env_exit_futex = NULL;
+
+	// No demand-paged program image until load_icode registers one.
+	e->env_image = NULL;
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
 	// commit the allocation
-	env_free_list = e->env_link;
+	env_free_list = ENVSCHED(e)->env_link;
 	*newenv_store = e;
 
 	cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 	return 0;
 }
 
+//
+// Allocates a new environment, like env_alloc(), that shares parent's
+// address space instead of getting one of its own: a thread.
+// The page directory's pp_ref counts the environments sharing it, and
+// the user mappings are torn down only when the last of them is freed.
+//
+// Returns 0 on success, < 0 on failure, as env_alloc().
+//
+int
+env_alloc_thread(struct Env **newenv_store, struct Env *parent)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = env_alloc(&e, parent->env_id)) < 0)
+		return r;
+	env_unmap_user(e);
+	vdso_share(e, parent);
+	env_put_vm(e);
+	e->env_pgdir = parent->env_pgdir;
+	pa2page(PADDR(e->env_pgdir))->pp_ref++;
+	e->env_type = parent->env_type;
+	e->env_image = parent->env_image;
+	e->env_pgfault_upcall = parent->env_pgfault_upcall;
+	*newenv_store = e;
+	return 0;
+}
+
 //
 // Allocate len bytes of physical memory for environment env,
 // and map it at virtual address va in the environment's address space.
@@ -341,7 +588,7 @@ region_alloc(struct Env *e, void *va, size_t len)
 	        panic("region_alloc: Allocation for user environment page failed...\n");
 	    }
 	    // ++pp->pp_ref;
-	    int ret = page_insert(e->env_pgdir, pp, rva, PTE_W | PTE_U);
+	    int ret = env_page_insert(e, pp, rva, PTE_W | PTE_U);
 	    if (ret < 0) {
 	        panic("region_alloc: %e\n", ret);
 	    }
@@ -482,31 +729,32 @@ load_icode(struct Env *e, uint8_t *binary)
         }
 	}
 	 */
-	// switch to work under user address mappings
-    lcr3(PADDR(e->env_pgdir));
-    for (; ph < phEnd; ++ph) {
-        if (ph->p_type != ELF_PROG_LOAD) {
-            // does not load this type according to Hints
-            continue;
-        }
-        // read information on mapping
-        if (ph->p_memsz < ph->p_filesz) {
-            panic("ELF size in memory less than size in file...\n");
-        }
-        // allocate space before copying
-        region_alloc(e, (void *)ph->p_va, ph->p_memsz);
-        // make mappings
-        // copy to virtual address
-        memcpy((void *)ph->p_va, binary + ph->p_offset, ph->p_filesz);
-        // set the rest to 0s according to Hints
-        memset((void *)(ph->p_va + ph->p_filesz), 0, ph->p_memsz - ph->p_filesz);
-        //memset((void *)ph->p_va, 0, ph->p_memsz);
-        //memcpy((void *)ph->p_va, binary + ph->p_offset, ph->p_filesz);
-    }
-    // switch back to kernel address mappings
-    lcr3(PADDR(kern_pgdir));
+	// All envs created from the same binary share one cached image,
+	// keyed by its _binary_obj_*_start symbol.
+	struct Image *img = image_lookup(binary);
+#ifdef LAZY_ICODE
+	// Demand paging: just register the image's segments with e.
+	// Each page is populated on its first fault (or user_mem_check)
+	// by image_map_page().
+	e->env_image = img;
+#else
+	// Map every page now: text and rodata as the image's shared
+	// read-only copies, data and bss as private copies.  Pages are
+	// filled through their kernel mappings, so e's page directory
+	// need not be loaded.
+	uintptr_t va;
+	int r;
+	for (; ph < phEnd; ++ph) {
+		if (ph->p_type != ELF_PROG_LOAD)
+			continue;
+		for (va = ROUNDDOWN(ph->p_va, PGSIZE);
+		     va < ph->p_va + ph->p_memsz; va += PGSIZE)
+			if ((r = image_map_page(e, img, va)) < 0)
+				panic("load_icode: %e", r);
+	}
+#endif
     // set runnable status
-    e->env_status = ENV_RUNNABLE;
+    ENVSCHED(e)->env_status = ENV_RUNNABLE;
 	// set entry in trap frame
 	// other parts of env_tf is set in function env_alloc
 	e->env_tf.tf_eip = elfHeader->e_entry;
@@ -540,74 +788,98 @@ env_create(uint8_t *binary, enum EnvType type)
 
 //
 // Frees env e and all memory it uses.
+// e must already be unlinked (ENV_FREE) and off every CPU.
 //
-void
+static void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint32_t pdeno, pteno;
-	physaddr_t pa;
+	uint32_t i;
+	struct Env *sib;
+
+	// Other threads still use the address space: hand the page tables
+	// e has used over to one of them, to be torn down with the last.
+	if (pa2page(PADDR(e->env_pgdir))->pp_ref > 1) {
+		for (sib = envs; sib < envs + NENV; sib++)
+			if (sib != e && sib->env_pgdir == e->env_pgdir)
+				break;
+		assert(sib < envs + NENV);
+		for (i = 0; i < ENV_PTMAP_NWORDS; i++)
+			sib->env_ptmap[i] |= e->env_ptmap[i];
+		goto put_vm;
+	}
 
-	// If freeing the current environment, switch to kern_pgdir
-	// before freeing the page directory, just in case the page
-	// gets reused.
-	if (e == curenv)
+	// If this CPU still has e's page directory loaded (e is the
+	// current environment, or was the last one run here), switch to
+	// kern_pgdir before tearing it down.  This single CR3 load flushes
+	// every user TLB entry, so the pages below can be released straight
+	// from the PTE array without a tlb_invalidate() for each one.  No
+	// other CPU can be running on e's page directory: env_destroy()
+	// never queues an environment that is running elsewhere.
+	if (rcr3() == PADDR(e->env_pgdir))
 		lcr3(PADDR(kern_pgdir));
 
-	// Note the environment's demise.
-	cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
-
-	// Flush all mapped pages in the user portion of the address space
-	static_assert(UTOP % PTSIZE == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+	// Flush all mapped pages in the user portion of the address space.
+	env_unmap_user(e);
 
-		// only look at mapped page tables
-		if (!(e->env_pgdir[pdeno] & PTE_P))
-			continue;
+	// free (or recycle) the page directory
+put_vm:
+	vdso_release(e);
+	env_put_vm(e);
 
-		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t*) KADDR(pa);
+	// return the environment to the free list
+	ENVSCHED(e)->env_link = env_free_list;
+	env_free_list = e;
+}
 
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
-		}
+//
+// Frees up to 'batch' destroyed environments queued by env_destroy().
+// Called from the idle path in sched_halt(), and synchronously by
+// env_alloc() and page_alloc() when they run out.
+// Returns the number of environments reclaimed.
+//
+int
+env_reclaim(int batch)
+{
+	struct Env *e;
+	int n;
 
-		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
+	for (n = 0; n < batch && (e = env_reclaim_list); n++) {
+		env_reclaim_list = ENVSCHED(e)->env_link;
+		env_free(e);
 	}
-
-	// free the page directory
-	pa = PADDR(e->env_pgdir);
-	e->env_pgdir = 0;
-	page_decref(pa2page(pa));
-
-    // return the environment to the free list
-	e->env_status = ENV_FREE;
-	e->env_link = env_free_list;
-	env_free_list = e;
+	return n;
 }
 
 //
-// Frees environment e.
+// Destroys environment e.
+// e is unlinked immediately (its status becomes ENV_FREE, so envid2env
+// no longer finds it) but its memory is only queued for env_reclaim().
 // If e was the current env, then runs a new environment (and does not return
 // to the caller).
 //
 void
 env_destroy(struct Env *e)
 {
+	// A sleeping environment must not be woken once it is gone.
+	timer_cancel(ENVTIMER(e));
+	futex_cancel(e);
+
 	// If e is currently running on other CPUs, we change its state to
-	// ENV_DYING. A zombie environment will be freed the next time
+	// ENV_DYING. A zombie environment will be destroyed the next time
 	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+	if ((ENVSCHED(e)->env_status == ENV_RUNNING ||
+	     ENVSCHED(e)->env_status == ENV_DYING) && curenv != e) {
+		ENVSCHED(e)->env_status = ENV_DYING;
 		return;
 	}
 
-	env_free(e);
+	// Note the environment's demise.
+	cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
+	futex_exit(e);
+
+	ENVSCHED(e)->env_status = ENV_FREE;
+	ENVSCHED(e)->env_link = env_reclaim_list;
+	env_reclaim_list = e;
 
 	if (curenv == e) {
 		curenv = NULL;
@@ -616,6 +888,60 @@ env_destroy(struct Env *e)
 }
 
 
+// CPU time accounting.  env_tstamp marks the start of the interval e
+// is in now: user time runs from env_run() to the next trap, kernel
+// time from the trap until e goes back to user mode or leaves the CPU,
+// and wait time from becoming runnable until env_run() picks e again.
+// Time spent blocked is not charged anywhere.
+//
+// Add the cycles since env_tstamp to *bucket, if bucket is non-NULL,
+// and start a new interval now.
+void
+env_account(struct Env *e, uint64_t *bucket)
+{
+	uint64_t now = read_tsc();
+
+	if (bucket)
+		*bucket += now - e->env_tstamp;
+	e->env_tstamp = now;
+}
+
+//
+// Lazy FPU switching.  While CR0.TS is set, this CPU's FPU does not
+// hold curenv's state, and curenv's first FPU or SSE instruction traps
+// with #NM into env_fpu_trap(), which loads it.  So if TS is still set
+// when curenv leaves the CPU, it never used the FPU and there is
+// nothing to save; environments that do no floating point never pay
+// for FXSAVE/FXRSTOR.
+//
+// Called whenever curenv is about to stop running on this CPU.
+//
+void
+env_fpu_release(void)
+{
+	if (rcr0() & CR0_TS)
+		return;
+	// curenv is NULL if it was just destroyed: drop its state
+	if (curenv)
+		fxsave(ENVFPU(curenv));
+	lcr0(rcr0() | CR0_TS);
+}
+
+//
+// Handles the #NM (device not available) trap: curenv wants the FPU.
+//
+void
+env_fpu_trap(struct Trapframe *tf)
+{
+	if (!env_fpu_fxsr) {
+		cprintf("[%08x] FPU/SSE not supported\n", curenv->env_id);
+		env_destroy(curenv);
+		return;
+	}
+	clts();
+	fxrstor(ENVFPU(curenv));
+}
+
 //
 // Restores the register values in the Trapframe with the 'iret' instruction.
 // This exits the kernel and starts executing some environment's code.
@@ -625,8 +951,12 @@ env_destroy(struct Env *e)
 void
 env_pop_tf(struct Trapframe *tf/*, pde_t *env_pgdir*/)
 {
-	// Record the CPU we are running on for user-space debugging
-	curenv->env_cpunum = cpunum();
+	// Record the CPU we are running on for user-space debugging,
+	// and count moves from the CPU it last ran on
+	if (ENVSCHED(curenv)->env_cpunum != thiscpu->cpu_id
+	    && ENVSCHED(curenv)->env_runs > 1)
+		ENVSCHED(curenv)->env_migrations++;
+	ENVSCHED(curenv)->env_cpunum = thiscpu->cpu_id;
 
 	asm volatile(
 		"\tmovl %0,%%esp\n"
@@ -668,17 +998,24 @@ env_run(struct Env *e)
 	// LAB 3: Your code here.
 	// panic("env_run not yet implemented");
 	// Step 1
+	if (curenv != e)
+		env_fpu_release();
+	if (curenv)
+		env_account(curenv, &curenv->env_stime);
+	if (curenv != e && ENVSCHED(e)->env_status == ENV_RUNNABLE)
+		env_account(e, &e->env_wtime);
 	if (curenv) {
-	    if (curenv->env_status == ENV_RUNNING) {
-            curenv->env_status = ENV_RUNNABLE;
+	    if (ENVSCHED(curenv)->env_status == ENV_RUNNING) {
+            ENVSCHED(curenv)->env_status = ENV_RUNNABLE;
         }
 	}
     curenv = e;
-    curenv->env_status = ENV_RUNNING;
-	++curenv->env_runs;
+    ENVSCHED(curenv)->env_status = ENV_RUNNING;
+	++ENVSCHED(curenv)->env_runs;
 //	cprintf("[kernel] CPU %d running user envid %08x\n", thiscpu->cpu_id, curenv->env_id);
 	// change of page directory should be in env_pop_tf
     lcr3(PADDR(curenv->env_pgdir));
+    vdso_run(curenv);
     // Step 2
     /*
       env_pop_tf does the following things:
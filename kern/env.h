@@ -5,15 +5,38 @@
 
 #include <inc/env.h>
 #include <kern/cpu.h>
+#include <kern/timer.h>
 
 extern struct Env *envs;		// All environments
+extern struct EnvSched *envsched;	// Scheduling state, parallel to envs
+extern struct FpuState *envfpu;		// FPU/SSE state, parallel to envs
+extern struct Timer *envtimer;		// Sleep/timeout timers, parallel to envs
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
+// FXSAVE image of an environment's x87/MMX/SSE registers
+struct FpuState {
+	uint8_t fs_fxsave[512];
+} __attribute__((aligned(16)));
+
+#define ENVFPU(e)	(&envfpu[(e) - envs])
+#define ENVTIMER(e)	(&envtimer[(e) - envs])
+
+// Destroyed environments freed per idle pass of sched_halt()
+#define ENV_RECLAIM_BATCH	8
+
 void	env_init(void);
 void	env_init_percpu(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
-void	env_free(struct Env *e);
+int	env_alloc_thread(struct Env **e, struct Env *parent);
+int	env_reclaim(int batch);
+int	env_pgdir_flush(void);
+void	env_fpu_release(void);
+void	env_account(struct Env *e, uint64_t *bucket);
+void	env_fpu_trap(struct Trapframe *tf);
+int	env_page_insert(struct Env *e, struct PageInfo *pp, void *va, int perm);
+int	env_page_map_range(struct Env *e, void *dstva, pde_t *srcpgdir,
+			   void *srcva, size_t npages, int perm);
 void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
 
@@ -0,0 +1,159 @@
+// Futexes: blocking waits on a word of user memory.
+//
+// A waiter is keyed by the physical address of the word it waits on,
+// so environments that share a page (through sys_page_map, IPC, or
+// PTE_SHARE across fork) find each other whatever virtual address
+// each of them has the page at, while copy-on-write copies do not.
+//
+// Waiters hang off a small hash table, oldest first.  Each environment
+// waits on at most one futex, so the queue links live in an array
+// parallel to envs.  Everything here runs under the big kernel lock,
+// which is what makes the check of *addr in futex_wait atomic with
+// respect to futex_wake.
+
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/memlayout.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/futex.h>
+
+#define FUTEX_HASH_BITS	6
+#define FUTEX_HASH_SIZE	(1 << FUTEX_HASH_BITS)
+
+struct FutexWaiter {
+	struct FutexWaiter *fw_next;
+	physaddr_t fw_key;		// 0 while not waiting
+};
+
+static struct FutexWaiter futex_waiters[NENV];
+static struct FutexWaiter *futex_hash[FUTEX_HASH_SIZE];
+
+static struct FutexWaiter **
+futex_bucket(physaddr_t key)
+{
+	return &futex_hash[(key * 2654435761U) >> (32 - FUTEX_HASH_BITS)];
+}
+
+// Translate the user address addr in curenv to the physical address
+// that keys its waiters.  Returns 0 on success, < 0 on error:
+//	-E_INVAL if addr is not word-aligned or not below UTOP.
+//	-E_FAULT if addr is not mapped readable by the user.
+static int
+futex_key(volatile uint32_t *addr, physaddr_t *key)
+{
+	pte_t *pte;
+
+	if ((uintptr_t) addr % sizeof(uint32_t) || (uintptr_t) addr >= UTOP)
+		return -E_INVAL;
+	if (user_mem_check(curenv, (void *) addr, sizeof(*addr), PTE_U) < 0)
+		return -E_FAULT;
+	page_lookup(curenv->env_pgdir, (void *) addr, &pte);
+	*key = PTE_ADDR(*pte) | PGOFF(addr);
+	return 0;
+}
+
+// Block curenv until a futex_wake on addr, if *addr still holds
+// expected; the check and the sleep are atomic with respect to wakers.
+// Returns 0 without blocking if *addr != expected, and < 0 on error
+// (see futex_key).  Otherwise does not return: the system call
+// returns 0 once woken.
+int
+futex_wait(volatile uint32_t *addr, uint32_t expected)
+{
+	struct FutexWaiter *w = &futex_waiters[curenv - envs], **pw;
+	physaddr_t key;
+	int r;
+
+	if ((r = futex_key(addr, &key)) < 0)
+		return r;
+	if (*addr != expected)
+		return 0;
+
+	w->fw_key = key;
+	w->fw_next = NULL;
+	for (pw = futex_bucket(key); *pw; pw = &(*pw)->fw_next)
+		;
+	*pw = w;
+
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	ENVSCHED(curenv)->env_status = ENV_NOT_RUNNABLE;
+	sched_yield();
+}
+
+// Wake up to n environments waiting on the word at physical address
+// key, oldest first.  Returns the number woken.
+static int
+futex_wake_key(physaddr_t key, uint32_t n)
+{
+	struct FutexWaiter *w, **pw;
+	struct Env *e;
+	int woken = 0;
+
+	pw = futex_bucket(key);
+	while (woken < n && (w = *pw) != NULL) {
+		if (w->fw_key != key) {
+			pw = &w->fw_next;
+			continue;
+		}
+		*pw = w->fw_next;
+		w->fw_key = 0;
+		e = &envs[w - futex_waiters];
+		ENVSCHED(e)->env_status = ENV_RUNNABLE;
+		sched_wakeup(e);
+		woken++;
+	}
+	return woken;
+}
+
+// Wake up to n environments waiting on addr, oldest first.
+// Returns the number woken, or < 0 on error (see futex_key).
+int
+futex_wake(volatile uint32_t *addr, uint32_t n)
+{
+	physaddr_t key;
+	int r;
+
+	if ((r = futex_key(addr, &key)) < 0)
+		return r;
+	return futex_wake_key(key, n);
+}
+
+// e is exiting: if it asked for it (see sys_thread_create), clear the
+// word at e->env_exit_futex and wake everyone waiting on it, so that
+// threads joining e can tell it is gone.  The write goes through e's
+// page tables, since e's address space need not be the current one.
+void
+futex_exit(struct Env *e)
+{
+	uintptr_t va = (uintptr_t) e->env_exit_futex;
+	pte_t *pte;
+	physaddr_t key;
+
+	if (!va)
+		return;
+	e->env_exit_futex = NULL;
+	if (!page_lookup(e->env_pgdir, (void *) va, &pte)
+	    || (*pte & (PTE_P | PTE_U | PTE_W)) != (PTE_P | PTE_U | PTE_W))
+		return;
+	key = PTE_ADDR(*pte) | PGOFF(va);
+	*(uint32_t *) KADDR(key) = 0;
+	futex_wake_key(key, ~0U);
+}
+
+// Take e off any futex queue, when it is destroyed or made runnable
+// by other means.
+void
+futex_cancel(struct Env *e)
+{
+	struct FutexWaiter *w = &futex_waiters[e - envs], **pw;
+
+	if (!w->fw_key)
+		return;
+	for (pw = futex_bucket(w->fw_key); *pw != w; pw = &(*pw)->fw_next)
+		;
+	*pw = w->fw_next;
+	w->fw_key = 0;
+}
@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+int	futex_wait(volatile uint32_t *addr, uint32_t expected);
+int	futex_wake(volatile uint32_t *addr, uint32_t n);
+void	futex_cancel(struct Env *e);
+void	futex_exit(struct Env *e);
+
+#endif	// !JOS_KERN_FUTEX_H
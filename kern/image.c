@@ -0,0 +1,147 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/elf.h>
+
+#include <kern/image.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+
+// One entry per _binary_obj_*_start symbol that has been loaded.
+// Entries, like the binaries they describe, are never freed.
+static struct Image images[NIMAGE];
+static int nimages;
+
+//
+// Returns the cache entry for the ELF image at 'binary', creating it
+// on first use.  Panics if the image is malformed, just as load_icode
+// would.
+//
+struct Image *
+image_lookup(uint8_t *binary)
+{
+	struct Elf *elf = (struct Elf *) binary;
+	struct Proghdr *ph, *eph;
+	struct PageInfo *pp;
+	struct Image *img;
+	int i;
+
+	for (i = 0; i < nimages; i++)
+		if (images[i].img_binary == binary)
+			return &images[i];
+
+	if (elf->e_magic != ELF_MAGIC)
+		panic("image_lookup: bad ELF magic");
+	ph = (struct Proghdr *) (binary + elf->e_phoff);
+	for (eph = ph + elf->e_phnum; ph < eph; ph++) {
+		if (ph->p_type != ELF_PROG_LOAD)
+			continue;
+		if (ph->p_memsz < ph->p_filesz)
+			panic("image_lookup: segment memsz < filesz");
+		if (ph->p_va + ph->p_memsz < ph->p_va
+		    || ph->p_va + ph->p_memsz > UTOP)
+			panic("image_lookup: segment above UTOP");
+	}
+
+	if (nimages == NIMAGE)
+		panic("image_lookup: too many program images");
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		panic("image_lookup: out of memory");
+	pp->pp_ref++;
+
+	img = &images[nimages++];
+	img->img_binary = binary;
+	img->img_pgdir = page2kva(pp);
+	return img;
+}
+
+//
+// Returns the PT_LOAD segment of img whose pages cover va, or NULL.
+//
+static struct Proghdr *
+image_segment(struct Image *img, uintptr_t va)
+{
+	struct Elf *elf = (struct Elf *) img->img_binary;
+	struct Proghdr *ph, *eph;
+
+	ph = (struct Proghdr *) (img->img_binary + elf->e_phoff);
+	for (eph = ph + elf->e_phnum; ph < eph; ph++)
+		if (ph->p_type == ELF_PROG_LOAD
+		    && va >= ROUNDDOWN(ph->p_va, PGSIZE)
+		    && va < ROUNDUP(ph->p_va + ph->p_memsz, PGSIZE))
+			return ph;
+	return NULL;
+}
+
+//
+// Fills pp with the page of segment ph at va: the part of the
+// segment's file contents that falls in the page, zeroes elsewhere.
+// Pages lying wholly inside the file contents are a single copy_page.
+//
+static void
+image_fill_page(struct Image *img, struct Proghdr *ph, uintptr_t va,
+		struct PageInfo *pp)
+{
+	uintptr_t start = MAX(va, ph->p_va);
+	uintptr_t end = MIN(va + PGSIZE, ph->p_va + ph->p_filesz);
+	const uint8_t *src = img->img_binary + ph->p_offset + (start - ph->p_va);
+	char *kva = page2kva(pp);
+
+	if (start == va && end == va + PGSIZE) {
+		copy_page(kva, src);
+		return;
+	}
+	if (start >= end) {
+		zero_page(kva);
+		return;
+	}
+	memset(kva, 0, start - va);
+	memcpy(kva + (start - va), src, end - start);
+	memset(kva + (end - va), 0, va + PGSIZE - end);
+}
+
+//
+// Maps the page of img containing va into e.
+// Pages of read-only segments (text, rodata) are shared, read-only,
+// with every other environment using img; the image holds its own
+// reference so they outlive all of them.  Pages of writable segments
+// (data, bss) are private copies.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va is not in any loadable segment of img.
+//	-E_NO_MEM if a page or page table could not be allocated.
+//
+int
+image_map_page(struct Env *e, struct Image *img, uintptr_t va)
+{
+	struct Proghdr *ph;
+	struct PageInfo *pp;
+	int r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if (!(ph = image_segment(img, va)))
+		return -E_INVAL;
+
+	if (!(ph->p_flags & ELF_PROG_FLAG_WRITE)) {
+		if (!(pp = page_lookup(img->img_pgdir, (void *) va, NULL))) {
+			if (!(pp = page_alloc(0)))
+				return -E_NO_MEM;
+			image_fill_page(img, ph, va, pp);
+			if ((r = page_insert(img->img_pgdir, pp,
+					     (void *) va, PTE_U)) < 0) {
+				page_free(pp);
+				return r;
+			}
+		}
+		return env_page_insert(e, pp, (void *) va, PTE_U);
+	}
+
+	if (!(pp = page_alloc(0)))
+		return -E_NO_MEM;
+	image_fill_page(img, ph, va, pp);
+	if ((r = env_page_insert(e, pp, (void *) va, PTE_U | PTE_W)) < 0)
+		page_free(pp);
+	return r;
+}
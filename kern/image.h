@@ -0,0 +1,25 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_IMAGE_H
+#define JOS_KERN_IMAGE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+#define NIMAGE		64		// Max distinct user program images
+
+// A user program image linked into the kernel (see ENV_CREATE),
+// together with the copies of its read-only pages that are shared by
+// every environment created from it.
+struct Image {
+	uint8_t *img_binary;		// _binary_obj_*_start
+	pde_t *img_pgdir;		// Shared pages, mapped at their user va
+					// (never loaded into CR3)
+};
+
+struct Image *image_lookup(uint8_t *binary);
+int	image_map_page(struct Env *e, struct Image *img, uintptr_t va);
+
+#endif	// !JOS_KERN_IMAGE_H
@@ -3,6 +3,7 @@
 #include <inc/stdio.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 #include <kern/monitor.h>
 #include <kern/console.h>
@@ -14,6 +15,9 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/time.h>
+#include <kern/timer.h>
+#include <kern/vdso.h>
 
 static void boot_aps(void);
 
@@ -21,14 +25,29 @@ static void boot_aps(void);
 void
 i386_init(void)
 {
+	// The TSC counts from zero at reset, so this is the time spent
+	// in the BIOS and boot loader (reported for the grade scripts).
+	uint64_t boot_tsc = read_tsc();
+
+	// Load the GDT and this CPU's per-CPU segment before anything
+	// (locks, tlb_invalidate) looks at thiscpu.  Without a LAPIC
+	// mapping yet, cpunum() is 0, as thiscpu always assumed here.
+	env_init_percpu();
+
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
 
 	cprintf("6828 decimal is %o octal!\n", 6828);
+	cprintf("boot: reached i386_init after %llu cycles\n", boot_tsc);
+
+	// Calibrate the TSC for udelay() and time_ns()
+	time_init();
+	timer_init();
 
 	// Lab 2 memory management initialization functions
 	mem_init();
+	vdso_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
@@ -37,6 +56,9 @@ i386_init(void)
 	// Lab 4 multiprocessor initialization functions
 	mp_init();
 	lapic_init();
+	// Now that cpunum() reads the real LAPIC ID, reselect the
+	// boot CPU's per-CPU segment.
+	env_init_percpu();
 
 	// Lab 4 multitasking initialization functions
 	pic_init();
@@ -65,11 +87,6 @@ i386_init(void)
 		monitor(NULL);
 }
 
-// While boot_aps is booting a given CPU, it communicates the per-core
-// stack pointer that should be loaded by mpentry.S to that CPU in
-// this variable.
-void *mpentry_kstack;
-
 // Start the non-boot (AP) processors.
 static void
 boot_aps(void)
@@ -77,24 +94,29 @@ boot_aps(void)
 	extern unsigned char mpentry_start[], mpentry_end[];
 	void *code;
 	struct CpuInfo *c;
+	uint64_t start;
+
+	if (ncpu == 1)
+		return;
 
 	// Write entry code to unused memory at MPENTRY_PADDR
 	code = KADDR(MPENTRY_PADDR);
 	memmove(code, mpentry_start, mpentry_end - mpentry_start);
 
-	// Boot each AP one at a time
+	// Boot all APs at once.  Each one picks its own stack by APIC ID
+	// in mpentry.S, so they run their setup in mp_main() in parallel.
+	start = read_tsc();
+	lapic_startap_all(PADDR(code));
+
+	// Wait for every CPU to finish some basic setup in mp_main()
 	for (c = cpus; c < cpus + ncpu; c++) {
 		if (c == cpus + cpunum())  // We've started already.
 			continue;
-
-		// Tell mpentry.S what stack to use 
-		mpentry_kstack = percpu_kstacks[c - cpus] + KSTKSIZE;
-		// Start the CPU at mpentry_start
-		lapic_startap(c->cpu_id, PADDR(code));
-		// Wait for the CPU to finish some basic setup in mp_main()
 		while(c->cpu_status != CPU_STARTED)
 			;
 	}
+	cprintf("SMP: started %d CPU(s) in %llu cycles\n",
+		ncpu, read_tsc() - start);
 }
 
 // Setup code for APs
@@ -103,10 +125,11 @@ mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
 	lcr3(PADDR(kern_pgdir));
+	// Per-CPU segment first: thiscpu is unusable until it is loaded
+	env_init_percpu();
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
-	env_init_percpu();
 	trap_init_percpu();
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
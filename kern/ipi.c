@@ -0,0 +1,150 @@
+// Cross-CPU function calls.
+//
+// ipi_call() queues a call on each target CPU's call queue and sends
+// the targets one IRQ_CALL IPI.  A target runs its queued calls from
+// the IPI handler (see trap()), or while it spins waiting for the big
+// kernel lock, and counts each call off as it finishes.  The caller
+// can carry on and check ipi_call_done() later, or ipi_call_wait().
+//
+// Calls run in interrupt context, usually without the big kernel lock,
+// so they must be short, must not block, and must not take the lock.
+
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+#include <inc/trap.h>
+
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/ipi.h>
+
+// Calls that can be queued on one CPU at a time
+#define IPI_QUEUE_LEN	16
+
+struct IpiQueue {
+	struct spinlock iq_lock;
+	volatile uint32_t iq_head;	// Next call to run
+	volatile uint32_t iq_tail;	// Next free slot
+	struct IpiCall *iq_calls[IPI_QUEUE_LEN];
+} __attribute__((aligned(64)));	// one per cache line: no false sharing
+
+static struct IpiQueue ipi_queues[NCPU];
+
+static inline void
+ipi_call_finish(struct IpiCall *call)
+{
+	asm volatile("lock; decl %0" : "+m" (call->ic_pending) : : "cc", "memory");
+}
+
+static bool
+ipi_enqueue(struct IpiQueue *q, struct IpiCall *call)
+{
+	bool queued = 0;
+
+	spin_lock(&q->iq_lock);
+	if (q->iq_tail - q->iq_head < IPI_QUEUE_LEN) {
+		q->iq_calls[q->iq_tail++ % IPI_QUEUE_LEN] = call;
+		queued = 1;
+	}
+	spin_unlock(&q->iq_lock);
+	return queued;
+}
+
+//
+// Run func(arg) on every started CPU in cpumask, a set of CPUMASK()
+// bits.  If this CPU is in the set, func runs here before ipi_call
+// returns; the other CPUs run it asynchronously.  call tracks
+// completion and must stay valid until ipi_call_done(call).
+//
+void
+ipi_call(struct IpiCall *call, uint32_t cpumask, void (*func)(void *),
+	 void *arg)
+{
+	struct CpuInfo *c;
+	uint32_t self = CPUMASK(thiscpu->cpu_id);
+	uint8_t sent = 0;
+	int n = 0;
+
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c->cpu_status == CPU_UNUSED)
+			cpumask &= ~CPUMASK(c->cpu_id);
+	cpumask &= CPUMASK(NCPU) - 1;
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (cpumask & CPUMASK(c->cpu_id))
+			n++;
+
+	call->ic_func = func;
+	call->ic_arg = arg;
+	call->ic_pending = n;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (!(cpumask & CPUMASK(c->cpu_id)) || c == thiscpu)
+			continue;
+		// If the target's queue is full, keep running our own
+		// calls meanwhile in case the target is waiting on us.
+		while (!ipi_enqueue(&ipi_queues[c - cpus], call))
+			ipi_call_poll();
+		sent |= CPUMASK(c->cpu_id);
+	}
+	if (sent)
+		lapic_ipi_mask(sent, IRQ_OFFSET + IRQ_CALL);
+
+	if (cpumask & self) {
+		func(arg);
+		ipi_call_finish(call);
+	}
+}
+
+// Return true once every target CPU has run call.
+bool
+ipi_call_done(struct IpiCall *call)
+{
+	return call->ic_pending == 0;
+}
+
+// Wait until every target CPU has run call, running this CPU's own
+// queued calls meanwhile so that two CPUs calling each other cannot
+// deadlock.
+void
+ipi_call_wait(struct IpiCall *call)
+{
+	while (!ipi_call_done(call)) {
+		ipi_call_poll();
+		asm volatile("pause");
+	}
+}
+
+// Run func(arg) on every started CPU in cpumask and wait for them all.
+void
+ipi_call_sync(uint32_t cpumask, void (*func)(void *), void *arg)
+{
+	struct IpiCall call;
+
+	ipi_call(&call, cpumask, func, arg);
+	ipi_call_wait(&call);
+}
+
+// Run every call queued on this CPU.
+void
+ipi_call_poll(void)
+{
+	struct IpiQueue *q = &ipi_queues[thiscpu - cpus];
+	struct IpiCall *call;
+	void (*func)(void *);
+	void *arg;
+
+	if (q->iq_head == q->iq_tail)
+		return;
+	spin_lock(&q->iq_lock);
+	while (q->iq_head != q->iq_tail) {
+		call = q->iq_calls[q->iq_head++ % IPI_QUEUE_LEN];
+		spin_unlock(&q->iq_lock);
+		// call may be gone as soon as it is finished
+		func = call->ic_func;
+		arg = call->ic_arg;
+		func(arg);
+		ipi_call_finish(call);
+		spin_lock(&q->iq_lock);
+	}
+	spin_unlock(&q->iq_lock);
+}
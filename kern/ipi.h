@@ -0,0 +1,27 @@
+#ifndef JOS_KERN_IPI_H
+#define JOS_KERN_IPI_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// A function call to run on a set of CPUs.  The caller owns the
+// struct and must keep it alive until ipi_call_done() says so.
+struct IpiCall {
+	void (*ic_func)(void *);	// Runs on each target CPU...
+	void *ic_arg;			// ...with this argument
+	volatile uint32_t ic_pending;	// Target CPUs that have yet to run it
+};
+
+// Bit for the CPU with APIC ID id (its cpus[] index) in a CPU mask
+#define CPUMASK(id)	(1U << (id))
+
+void	ipi_call(struct IpiCall *call, uint32_t cpumask,
+		 void (*func)(void *), void *arg);
+bool	ipi_call_done(struct IpiCall *call);
+void	ipi_call_wait(struct IpiCall *call);
+void	ipi_call_sync(uint32_t cpumask, void (*func)(void *), void *arg);
+void	ipi_call_poll(void);
+
+#endif	// !JOS_KERN_IPI_H
@@ -9,12 +9,16 @@
 #include <inc/x86.h>
 #include <kern/pmap.h>
 #include <kern/cpu.h>
+#include <kern/time.h>
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID      (0x0020/4)   // ID
 #define VER     (0x0030/4)   // Version
 #define TPR     (0x0080/4)   // Task Priority
 #define EOI     (0x00B0/4)   // EOI
+#define LDR     (0x00D0/4)   // Logical Destination
+#define DFR     (0x00E0/4)   // Destination Format
+	#define FLAT       0xFFFFFFFF   // Flat model: LDR is a CPU bitmap
 #define SVR     (0x00F0/4)   // Spurious Interrupt Vector
 	#define ENABLE     0x00000100   // Unit Enable
 #define ESR     (0x0280/4)   // Error Status
@@ -29,6 +33,7 @@
 	#define OTHERS     0x000C0000   // Send to all APICs, excluding self.
 	#define BUSY       0x00001000
 	#define FIXED      0x00000000
+	#define LOGICAL    0x00000800   // ICRHI holds a logical destination
 #define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
 #define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
 	#define X1         0x0000000B   // divide counts by 1
@@ -60,11 +65,22 @@ lapic_init(void)
 
 	// lapicaddr is the physical address of the LAPIC's 4K MMIO
 	// region.  Map it in to virtual memory so we can access it.
-	lapic = mmio_map_region(lapicaddr, 4096);
+	// Every CPU sees its own LAPIC at that address, so the BSP's
+	// mapping serves all of them; the APs, which come through here
+	// concurrently, must not call mmio_map_region() themselves.
+	if (!lapic)
+		lapic = mmio_map_region(lapicaddr, 4096);
 
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
+	// Use the flat logical destination model, in which the CPU with
+	// APIC ID n answers to bit n of a logical destination, so that
+	// lapic_ipi_mask() can reach any set of CPUs with a single IPI.
+	// NCPU is 8, the most the flat model can address.
+	lapicw(DFR, FLAT);
+	lapicw(LDR, (1 << cpunum()) << 24);
+
 	// The timer repeatedly counts down at bus frequency
 	// from lapic[TICR] and then issues an interrupt.  
 	// If we cared more about precise timekeeping,
@@ -80,7 +96,7 @@ lapic_init(void)
 	// BSP's local APIC in Virtual Wire Mode, in which 8259A's
 	// INTR is virtually connected to BSP's LINTIN0. In this mode,
 	// we do not need to program the IOAPIC.
-	if (thiscpu != bootcpu)
+	if (cpus + cpunum() != bootcpu)
 		lapicw(LINT0, MASKED);
 
 	// Disable NMI (LINT1) on all CPUs
@@ -127,19 +143,14 @@ lapic_eoi(void)
 		lapicw(EOI, 0);
 }
 
-// Spin for a given number of microseconds.
-// On real hardware would want to tune this dynamically.
-static void
-microdelay(int us)
-{
-}
-
 #define IO_RTC  0x70
 
-// Start additional processor running entry code at addr.
-// See Appendix B of MultiProcessor Specification.
+// Start every other processor running entry code at addr, all at once,
+// using the broadcast form of the universal startup algorithm.
+// Processors the MP table does not list are started too; mpentry.S
+// parks any whose APIC ID has no cpus[] slot.
 void
-lapic_startap(uint8_t apicid, uint32_t addr)
+lapic_startap_all(uint32_t addr)
 {
 	int i;
 	uint16_t *wrv;
@@ -147,36 +158,64 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	// "The BSP must initialize CMOS shutdown code to 0AH
 	// and the warm reset vector (DWORD based at 40:67) to point at
 	// the AP startup code prior to the [universal startup algorithm]."
+	// See Appendix B of MultiProcessor Specification.
 	outb(IO_RTC, 0xF);  // offset 0xF is shutdown code
 	outb(IO_RTC+1, 0x0A);
 	wrv = (uint16_t *)KADDR((0x40 << 4 | 0x67));  // Warm reset vector
 	wrv[0] = 0;
 	wrv[1] = addr >> 4;
 
-	// "Universal startup algorithm."
-	// Send INIT (level-triggered) interrupt to reset other CPU.
-	lapicw(ICRHI, apicid << 24);
-	lapicw(ICRLO, INIT | LEVEL | ASSERT);
-	microdelay(200);
-	lapicw(ICRLO, INIT | LEVEL);
-	microdelay(100);    // should be 10ms, but too slow in Bochs!
-
-	// Send startup IPI (twice!) to enter code.
-	// Regular hardware is supposed to only accept a STARTUP
-	// when it is in the halted state due to an INIT.  So the second
-	// should be ignored, but it is part of the official Intel algorithm.
-	// Bochs complains about the second one.  Too bad for Bochs.
+	lapicw(ICRHI, 0);
+	lapicw(ICRLO, OTHERS | INIT | LEVEL | ASSERT);
+	while (lapic[ICRLO] & DELIVS)
+		;
+	udelay(200);
+	lapicw(ICRLO, OTHERS | INIT | LEVEL);
+	while (lapic[ICRLO] & DELIVS)
+		;
+	udelay(100);
+
 	for (i = 0; i < 2; i++) {
-		lapicw(ICRHI, apicid << 24);
-		lapicw(ICRLO, STARTUP | (addr >> 12));
-		microdelay(200);
+		lapicw(ICRLO, OTHERS | STARTUP | (addr >> 12));
+		while (lapic[ICRLO] & DELIVS)
+			;
+		udelay(200);
 	}
 }
 
+// The IPI senders below do not wait for delivery of the IPI they
+// send, only (almost never for long) for the previous one to have
+// left the ICR before they overwrite it.
+static void
+lapic_icr_wait(void)
+{
+	while (lapic[ICRLO] & DELIVS)
+		asm volatile("pause");
+}
+
+// Send a fixed interrupt with the given vector to the CPU with the
+// given APIC ID.
+void
+lapic_ipi_cpu(uint8_t apicid, int vector)
+{
+	lapic_icr_wait();
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+}
+
+// Send a fixed interrupt with the given vector to every CPU whose
+// APIC ID's bit is set in apicmask, with one logical-mode IPI.
+void
+lapic_ipi_mask(uint8_t apicmask, int vector)
+{
+	lapic_icr_wait();
+	lapicw(ICRHI, apicmask << 24);
+	lapicw(ICRLO, LOGICAL | FIXED | vector);
+}
+
 void
 lapic_ipi(int vector)
 {
+	lapic_icr_wait();
 	lapicw(ICRLO, OTHERS | FIXED | vector);
-	while (lapic[ICRLO] & DELIVS)
-		;
 }
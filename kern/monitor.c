@@ -11,6 +11,11 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/ipi.h>
+#include <kern/time.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -29,6 +34,9 @@ static struct Command commands[] = {
     { "quit", "Exit kernel debug shell", mon_quitdebug },
     { "printtrap", "Print current TrapFrame", mon_printtrap },
     { "tracetrap", "Print trace of current Breakpoint", mon_trapcurtrace },
+    { "schedbench", "Time a scheduler scan over all env slots", mon_schedbench },
+    { "ipiping", "Time a cross-CPU call to each other CPU", mon_ipiping },
+    { "top", "List environments by CPU time used", mon_top },
 };
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -139,6 +147,186 @@ mon_printtrap(int argc, char **argv, struct Trapframe *tf) {
     return 0;
 }
 
+// struct Env as it was before the scheduling fields moved to envsched[]:
+// env_status sat behind the Trapframe, one slot per 120 bytes.
+struct OldEnv {
+	struct Trapframe env_tf;
+	struct Env *env_link;
+	envid_t env_id;
+	envid_t env_parent_id;
+	enum EnvType env_type;
+	unsigned env_status;
+	uint32_t env_runs;
+	int env_cpunum;
+	pde_t *env_pgdir;
+	void *env_pgfault_upcall;
+	bool env_ipc_recving;
+	void *env_ipc_dstva;
+	uint32_t env_ipc_value;
+	envid_t env_ipc_from;
+	int env_ipc_perm;
+};
+
+#define OLDENV_PER_PAGE	(PGSIZE / sizeof(struct OldEnv))
+#define OLDENV_PAGES	((NENV + OLDENV_PER_PAGE - 1) / OLDENV_PER_PAGE)
+
+// Time the scan sched_yield() does over every env slot for env_status,
+// once in the dense envsched[] array and once in a copy of the env
+// table laid out as struct OldEnv, which is what the scan walked before.
+// The copy lives in pages from page_alloc, which need not be contiguous,
+// so it is scanned a page at a time.
+int
+mon_schedbench(int argc, char **argv, struct Trapframe *tf)
+{
+	struct PageInfo *pp[OLDENV_PAGES];
+	volatile struct OldEnv *old;
+	int i, j, n, r, rounds, hits;
+	uint64_t start, old_cycles, sched_cycles;
+
+	rounds = (argc > 1) ? strtol(argv[1], NULL, 0) : 100;
+	if (rounds <= 0)
+		rounds = 1;
+
+	for (n = 0; n < OLDENV_PAGES; n++)
+		if (!(pp[n] = page_alloc(ALLOC_ZERO))) {
+			cprintf("schedbench: out of memory\n");
+			goto out;
+		}
+	for (i = 0; i < NENV; i++) {
+		old = page2kva(pp[i / OLDENV_PER_PAGE]);
+		old[i % OLDENV_PER_PAGE].env_id = envs[i].env_id;
+		old[i % OLDENV_PER_PAGE].env_status = envsched[i].env_status;
+	}
+
+	hits = 0;
+	start = read_tsc();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < NENV; i += OLDENV_PER_PAGE) {
+			old = page2kva(pp[i / OLDENV_PER_PAGE]);
+			for (j = 0; j < OLDENV_PER_PAGE && i + j < NENV; j++)
+				if (old[j].env_status == ENV_RUNNABLE)
+					hits++;
+		}
+	old_cycles = read_tsc() - start;
+
+	start = read_tsc();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < NENV; i++)
+			if (((volatile struct EnvSched *) envsched)[i].env_status == ENV_RUNNABLE)
+				hits++;
+	sched_cycles = read_tsc() - start;
+
+	cprintf("scan of %d env slots, %d rounds:\n", NENV, rounds);
+	cprintf("  old struct Env stride (%3d bytes/slot): %llu cycles/scan\n",
+		sizeof(struct OldEnv), old_cycles / rounds);
+	cprintf("  envsched[] stride     (%3d bytes/slot): %llu cycles/scan\n",
+		sizeof(struct EnvSched), sched_cycles / rounds);
+out:
+	while (n > 0)
+		page_free(pp[--n]);
+	return 0;
+}
+
+static void
+ipiping_nop(void *arg)
+{
+}
+
+// Time ipi_call_sync() round trips to each other started CPU, and one
+// call to all of them at once.
+int
+mon_ipiping(int argc, char **argv, struct Trapframe *tf)
+{
+	struct CpuInfo *c;
+	uint32_t all = 0;
+	uint64_t start, t;
+	int i, rounds;
+
+	rounds = (argc > 1) ? strtol(argv[1], NULL, 0) : 100;
+	if (rounds <= 0)
+		rounds = 1;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == thiscpu || c->cpu_status == CPU_UNUSED)
+			continue;
+		all |= CPUMASK(c->cpu_id);
+		start = read_tsc();
+		for (i = 0; i < rounds; i++)
+			ipi_call_sync(CPUMASK(c->cpu_id), ipiping_nop, NULL);
+		t = read_tsc() - start;
+		cprintf("CPU %d -> CPU %d: %llu cycles/call\n",
+			thiscpu->cpu_id, c->cpu_id, t / rounds);
+	}
+	if (!all) {
+		cprintf("no other CPUs\n");
+		return 0;
+	}
+	start = read_tsc();
+	for (i = 0; i < rounds; i++)
+		ipi_call_sync(all, ipiping_nop, NULL);
+	t = read_tsc() - start;
+	cprintf("CPU %d -> all others: %llu cycles/call\n",
+		thiscpu->cpu_id, t / rounds);
+	return 0;
+}
+
+static uint32_t
+cycles_to_ms(uint64_t cycles)
+{
+	return tsc_to_ns(cycles) / 1000000;
+}
+
+// List live environments, busiest first, with the CPU time each has
+// spent in user mode, in the kernel, and runnable but waiting for a
+// CPU.  %CPU is each env's share of the user plus kernel time of all
+// those listed.  An optional argument limits the number of rows.
+int
+mon_top(int argc, char **argv, struct Trapframe *tf)
+{
+	static const char * const status[] = {
+		"free", "dying", "runnable", "running", "blocked"
+	};
+	static int order[NENV];
+	uint64_t total = 0, busy;
+	struct Env *e;
+	int i, j, n = 0, rows;
+
+	rows = (argc > 1) ? strtol(argv[1], NULL, 0) : NENV;
+
+	// Insertion sort on user plus kernel time
+	for (i = 0; i < NENV; i++) {
+		if (envsched[i].env_status == ENV_FREE)
+			continue;
+		busy = envs[i].env_utime + envs[i].env_stime;
+		total += busy;
+		for (j = n++; j > 0; j--) {
+			e = &envs[order[j - 1]];
+			if (e->env_utime + e->env_stime >= busy)
+				break;
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+	}
+	if (n == 0) {
+		cprintf("no environments\n");
+		return 0;
+	}
+
+	cprintf("   envid  status    cpu   runs  migr   user ms    sys ms   wait ms  %%cpu\n");
+	for (i = 0; i < n && i < rows; i++) {
+		e = &envs[order[i]];
+		busy = e->env_utime + e->env_stime;
+		cprintf("%08x  %-8s  %3d %6u %5u %9u %9u %9u  %3u\n",
+			e->env_id, status[ENVSCHED(e)->env_status],
+			ENVSCHED(e)->env_cpunum, ENVSCHED(e)->env_runs,
+			ENVSCHED(e)->env_migrations,
+			cycles_to_ms(e->env_utime), cycles_to_ms(e->env_stime),
+			cycles_to_ms(e->env_wtime),
+			total ? (uint32_t) (busy * 100 / total) : 0);
+	}
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
@@ -21,5 +21,8 @@ int mon_quitdebug(int argc, char **argv, struct Trapframe *tf);
 int mon_printtrap(int argc, char **argv, struct Trapframe *tf);
 int mon_traptrace(int argc, char **argv, struct Trapframe *tf);
 int mon_trapcurtrace(int arg, char **argv, struct Trapframe *tf);
+int mon_schedbench(int argc, char **argv, struct Trapframe *tf);
+int mon_ipiping(int argc, char **argv, struct Trapframe *tf);
+int mon_top(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
@@ -10,6 +10,8 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/image.h>
+#include <kern/ipi.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -179,6 +181,15 @@ mem_init(void)
 	// LAB 3: Your code here.
 	envs = boot_alloc(NENV * sizeof(struct Env));
 	memset(envs, 0, sizeof(struct Env) * NENV);
+	// The scheduling-hot half of each Env lives in its own array;
+	// boot_alloc's page alignment keeps it cache-line aligned.
+	envsched = boot_alloc(NENV * sizeof(struct EnvSched));
+	memset(envsched, 0, sizeof(struct EnvSched) * NENV);
+	// FPU state is kernel-only and needs 16-byte alignment for FXSAVE.
+	envfpu = boot_alloc(NENV * sizeof(struct FpuState));
+	memset(envfpu, 0, sizeof(struct FpuState) * NENV);
+	envtimer = boot_alloc(NENV * sizeof(struct Timer));
+	memset(envtimer, 0, sizeof(struct Timer) * NENV);
 
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
@@ -211,7 +222,9 @@ mem_init(void)
 	//    - the new image at UENVS  -- kernel R, user R
 	//    - envs itself -- kernel RW, user NONE
 	// LAB 3: Your code here.
+    static_assert(NENV * sizeof(struct Env) <= UENVSCHED - UENVS);
     boot_map_region(kern_pgdir, UENVS, ROUNDUP(NENV * sizeof(struct Env), PGSIZE), PADDR(envs), PTE_U);
+    boot_map_region(kern_pgdir, UENVSCHED, ROUNDUP(NENV * sizeof(struct EnvSched), PGSIZE), PADDR(envsched), PTE_U);
 
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -431,7 +444,12 @@ page_alloc(int alloc_flags)
 	// Fill this function in
 	// Here begins my code
 
-	// out of memory
+	// out of memory: reclaim destroyed environments first, then give
+	// back the page directories they left in the cache
+	if (page_free_list == NULL)
+		env_reclaim(NENV);
+	if (page_free_list == NULL)
+		env_pgdir_flush();
 	if (page_free_list == NULL) {
 	    // no changes made so far of course
 	    return NULL;
@@ -442,7 +460,7 @@ page_alloc(int alloc_flags)
 	char *space_head = page2kva(target);          // extract kernel virtual memory
 	if (alloc_flags & ALLOC_ZERO) {
         // zero the page according to flags
-        memset(space_head, 0, PGSIZE);
+        zero_page(space_head);
 	}
 
 	return target;
@@ -646,31 +664,25 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	    // allocation failed
 	    return -E_NO_MEM;
 	}
-	if (*pte & PTE_P) {
-	    // page already mapped
-	    /*
-	    if (PTE_ADDR(*pte) == page2pa(pp)) {
-	        // remapped to same page, do nothing
-	        // don't know how to be elegant...
-	        return 0;
-	    }
-	     */
-	    if (PTE_ADDR(*pte) != page2pa(pp)) {
-	        // remove page only when not remapped
-            page_remove(pgdir, va);
-        }
-	}
+	pte_t old = *pte;
+	bool same = (old & PTE_P) && PTE_ADDR(old) == page2pa(pp);
 	/*
 	 * Even if the page is remapped to the same address, there won't be any bugs.
 	 * The permission fields must be reset by the function, as it is the purpose of this function.
-	 * The anotated code above tries a naive, unelegant approach, which may lead to subtle bugs of incompleteness of the function.
 	 */
-	if (PTE_ADDR(*pte) != page2pa(pp)) {
+	if (!same) {
 	    ++pp->pp_ref;
 	}
+	// Store the new PTE before invalidating: once the shootdown is
+	// done, no CPU sharing pgdir can reload the old entry.  Only then
+	// may the old page go.
 	*pte = page2pa(pp) | perm | PTE_P;
-	// must increment reference count
-	// another reason for the elegant implementation
+	if (old & PTE_P) {
+	    tlb_invalidate(pgdir, va);
+	    if (!same) {
+	        page_decref(pa2page(PTE_ADDR(old)));
+	    }
+	}
 	return 0;
 }
 
@@ -697,6 +709,9 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 	if (pte_store) {
 	    *pte_store = pte;
 	}
+	// the page table exists, but nothing is mapped at va
+	if (!(*pte & PTE_P))
+	    return NULL;
 	// pte is a kernel address, pointing to a place storing physical address
 	// thus can be used directly
     struct PageInfo *pageInfo = pa2page(PTE_ADDR(*pte));
@@ -728,10 +743,11 @@ page_remove(pde_t *pgdir, void *va)
 	    // page not mapped
 	    return;
 	}
-	page_decref(pageInfo);
-	// set pte not present
+	// set pte not present, and make sure no CPU still has it cached
+	// before the page can be freed
 	*pte = 0;
 	tlb_invalidate(pgdir, va);
+	page_decref(pageInfo);
 }
 
 //
@@ -744,6 +760,33 @@ tlb_invalidate(pde_t *pgdir, void *va)
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
+	// Threads sharing pgdir may be running on other CPUs.
+	if (pgdir != kern_pgdir && pa2page(PADDR(pgdir))->pp_ref > 1)
+		tlb_shootdown(pgdir, va);
+}
+
+static void
+tlb_shootdown_one(void *va)
+{
+	invlpg(va);
+}
+
+//
+// Invalidate va on every other CPU running an environment whose page
+// directory is pgdir, and wait until they all have.  A CPU that is not
+// running on pgdir now will load CR3, flushing its TLB, before it does.
+//
+void
+tlb_shootdown(pde_t *pgdir, void *va)
+{
+	struct CpuInfo *c;
+	uint32_t mask = 0;
+
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c != thiscpu && c->cpu_env && c->cpu_env->env_pgdir == pgdir)
+			mask |= CPUMASK(c->cpu_id);
+	if (mask)
+		ipi_call_sync(mask, tlb_shootdown_one, va);
 }
 
 //
@@ -826,6 +869,20 @@ check_perm_page_begin(pde_t *pgdir, const void *va, int perm) {
     }
     return 0;
 }
+
+// Like check_perm_page_begin() on env's page directory, but first
+// populates va if it is a not yet loaded page of env's program image.
+static int
+check_user_page(struct Env *env, const void *va, int perm)
+{
+	if (check_perm_page_begin(env->env_pgdir, va, perm) == 0)
+		return 0;
+	if (env->env_image && !page_lookup(env->env_pgdir, (void *) va, NULL)
+	    && image_map_page(env, env->env_image, (uintptr_t) va) == 0)
+		return check_perm_page_begin(env->env_pgdir, va, perm);
+	return -1;
+}
+
 int
 user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 {
@@ -837,13 +894,13 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 	perm |= PTE_P | PTE_U;
 	const void *va_begin = ROUNDDOWN(va, PGSIZE), *va_end = ROUNDUP(va + len, PGSIZE);
 	// check the first page directly
-	if (check_perm_page_begin(env->env_pgdir, va_begin, perm)) {
+	if (check_user_page(env, va_begin, perm)) {
 	    user_mem_check_addr = (uintptr_t)va;
 	    return -E_FAULT;
 	}
 	// check other pages
 	for (va = va_begin + PGSIZE; va < va_end; va += PGSIZE) {
-        if (check_perm_page_begin(env->env_pgdir, va, perm)) {
+        if (check_user_page(env, va, perm)) {
             user_mem_check_addr = (uintptr_t)va;
             return -E_FAULT;
         }
@@ -1050,6 +1107,9 @@ check_kern_pgdir(void)
 	n = ROUNDUP(NENV*sizeof(struct Env), PGSIZE);
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
+	n = ROUNDUP(NENV*sizeof(struct EnvSched), PGSIZE);
+	for (i = 0; i < n; i += PGSIZE)
+		assert(check_va2pa(pgdir, UENVSCHED + i) == PADDR(envsched) + i);
 
 	// check phys mem
 	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
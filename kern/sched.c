@@ -4,8 +4,12 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/cpu.h>
+#include <kern/timer.h>
+#include <kern/ipi.h>
 
 void sched_halt(void);
+void sched_wakeup(struct Env *e);
 
 // Choose a user environment to run and run it.
 void
@@ -70,15 +74,25 @@ sched_yield(void)
         }
     }
 */
+    uint8_t self = CPUMASK(thiscpu->cpu_id);
+
+    // curenv may no longer be allowed here: leave it for a CPU that is
+    if (curenv && ENVSCHED(curenv)->env_status == ENV_RUNNING
+        && !(ENVSCHED(curenv)->env_affinity & self)) {
+        ENVSCHED(curenv)->env_status = ENV_RUNNABLE;
+        sched_wakeup(curenv);
+    }
+
     uint32_t curenvIndex = (curenv?ENVX(curenv->env_id):0), offset; // curenv might be NULL!
     for (offset = 0; offset < NENV; ++offset) {
         uint32_t realIndex = (curenvIndex + offset) % NENV;
-        if(envs[realIndex].env_status == ENV_RUNNABLE){
+        if(envsched[realIndex].env_status == ENV_RUNNABLE
+           && (envsched[realIndex].env_affinity & self)){
             env_run(&envs[realIndex]); // switch to the first runnable environment.env_run will never return.
         }
     }
 
-    if (curenv && curenv->env_status == ENV_RUNNING) {
+    if (curenv && ENVSCHED(curenv)->env_status == ENV_RUNNING) {
         // no envs are runnable,but the environment previously running on this CPU is still running.
         // It's okay to choose this environment.
         env_run(curenv);
@@ -87,6 +101,36 @@ sched_yield(void)
 	sched_halt();
 }
 
+// Call after making e runnable.  Starts the clock on e's wait time.
+// A CPU idling in sched_halt() would only notice e on its next timer
+// tick, so if any CPU that e may run on (see env_affinity) is halted,
+// send one a reschedule IPI to make it look now.  The CPU e last ran
+// on is preferred, since its caches may still hold e's working set.
+//
+// No wakeup can be lost: a CPU marks itself CPU_HALTED while still
+// holding the big kernel lock, after its last look for runnable envs,
+// and callers hold the lock while making e runnable.
+void
+sched_wakeup(struct Env *e)
+{
+	struct CpuInfo *c;
+	uint8_t allowed = ENVSCHED(e)->env_affinity;
+
+	// e's wait for a CPU starts now
+	env_account(e, e == curenv ? &e->env_stime : NULL);
+
+	c = &cpus[ENVSCHED(e)->env_cpunum];
+	if (c->cpu_status != CPU_HALTED || !(allowed & CPUMASK(c->cpu_id))) {
+		for (c = cpus; c < cpus + ncpu; c++)
+			if (c->cpu_status == CPU_HALTED
+			    && (allowed & CPUMASK(c->cpu_id)))
+				break;
+		if (c == cpus + ncpu)
+			return;
+	}
+	lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+}
+
 // Halt this CPU when there is nothing to do. Wait until the
 // timer interrupt wakes it up. This function never returns.
 //
@@ -97,22 +141,32 @@ sched_halt(void)
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
+	// Environments that are asleep or waiting with a timeout will
+	// become runnable again, so they count as work.
 	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
+		if ((envsched[i].env_status == ENV_RUNNABLE ||
+		     envsched[i].env_status == ENV_RUNNING ||
+		     envsched[i].env_status == ENV_DYING))
 			break;
 	}
-	if (i == NENV) {
+	if (i == NENV && timer_npending == 0) {
+		env_reclaim(NENV);
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
 
 	// Mark that no environment is running on this CPU
+	env_fpu_release();
+	if (curenv)
+		env_account(curenv, &curenv->env_stime);
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
 
+	// Free a batch of destroyed environments while there is nothing
+	// else to do, keeping teardown off the sys_env_destroy() path.
+	env_reclaim(ENV_RECLAIM_BATCH);
+
 	// Mark that this CPU is in the HALT state, so that when
 	// timer interupts come in, we know we should re-acquire the
 	// big kernel lock
@@ -6,7 +6,10 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_wakeup(struct Env *e);
 
 #endif	// !JOS_KERN_SCHED_H
@@ -78,6 +78,27 @@ spin_lock(struct spinlock *lk)
 #endif
 }
 
+// Try once to acquire the lock.
+// Returns true if it was acquired, false if it is held elsewhere.
+bool
+spin_trylock(struct spinlock *lk)
+{
+#ifdef DEBUG_SPINLOCK
+	if (holding(lk))
+		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+#endif
+	// Only try the xchg, which takes the cache line exclusive, when
+	// the lock looks free.
+	if (((volatile struct spinlock *) lk)->locked
+	    || xchg(&lk->locked, 1) != 0)
+		return 0;
+#ifdef DEBUG_SPINLOCK
+	lk->cpu = thiscpu;
+	get_caller_pcs(lk->pcs);
+#endif
+	return 1;
+}
+
 // Release the lock.
 void
 spin_unlock(struct spinlock *lk)
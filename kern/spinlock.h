@@ -3,6 +3,7 @@
 
 #include <inc/types.h>
 #include <kern/cpu.h>
+#include <kern/ipi.h>
 
 // Comment this to disable spinlock debugging
 //#define DEBUG_SPINLOCK
@@ -22,6 +23,7 @@ struct spinlock {
 
 void __spin_initlock(struct spinlock *lk, char *name);
 void spin_lock(struct spinlock *lk);
+bool spin_trylock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
@@ -32,7 +34,12 @@ static inline void
 lock_kernel(void)
 {
 //    cprintf("[kernel] CPU %d fetching kernel lock\n", thiscpu->cpu_id);
-	spin_lock(&kernel_lock);
+	// Keep running cross-CPU calls while waiting, since the holder
+	// may be waiting for one of ours (see kern/ipi.c).
+	while (!spin_trylock(&kernel_lock)) {
+		ipi_call_poll();
+		asm volatile("pause");
+	}
 //    cprintf("[kernel] CPU %d kernel lock fetched\n", thiscpu->cpu_id);
 }
 
@@ -11,6 +11,10 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/time.h>
+#include <kern/timer.h>
+#include <kern/futex.h>
+#include <kern/ipi.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -96,10 +100,18 @@ sys_exofork(void)
 	    cprintf("env_alloc failed %e\n", ret);
 	    return ret;
 	}
-    // set not runnable
-    newEnv->env_status = ENV_NOT_RUNNABLE;
+    // set not runnable; the child may run where the parent may
+    ENVSCHED(newEnv)->env_status = ENV_NOT_RUNNABLE;
+    ENVSCHED(newEnv)->env_affinity = ENVSCHED(curenv)->env_affinity;
     // set registers
     newEnv->env_tf = curenv->env_tf;
+    // copy the FPU state as well; it may still be live in this CPU
+    if (rcr0() & CR0_TS)
+        *ENVFPU(newEnv) = *ENVFPU(curenv);
+    else
+        fxsave(ENVFPU(newEnv));
+    // child faults in the same untouched image pages as its parent
+    newEnv->env_image = curenv->env_image;
     // set child return value 0
     newEnv->env_tf.tf_regs.reg_eax = 0;
     // child eip not set in env_alloc, therefore must be set!
@@ -107,6 +119,77 @@ sys_exofork(void)
     return newEnv->env_id;
 }
 
+// Create a thread: a new, runnable environment that shares the current
+// environment's address space and page fault upcall.  It starts at 'eip'
+// with stack pointer 'esp', takes page faults on the exception stack
+// just below 'xstacktop', and other registers as the caller's but with
+// eax 0 and a fresh FPU state.  The caller provides (and maps) the
+// stacks.  If 'exit_futex' is nonzero, the kernel clears the word there
+// and wakes any futex waiters on it when the thread exits.
+//
+// Returns envid of the new thread, or < 0 on error.  Errors are:
+//	-E_INVAL if eip, esp or xstacktop is above UTOP, xstacktop is not
+//		page-aligned, or exit_futex is misaligned or above UTOP.
+//	-E_NO_FREE_ENV if no free environment is available.
+static envid_t
+sys_thread_create(uintptr_t eip, uintptr_t esp, uintptr_t xstacktop,
+		  uintptr_t exit_futex)
+{
+	struct Env *e;
+	int r;
+
+	if (eip >= UTOP || esp > UTOP || xstacktop > UTOP
+	    || xstacktop % PGSIZE || xstacktop < PGSIZE
+	    || exit_futex % sizeof(uint32_t) || exit_futex >= UTOP)
+		return -E_INVAL;
+	if ((r = env_alloc_thread(&e, curenv)) < 0)
+		return r;
+	e->env_tf = curenv->env_tf;
+	e->env_tf.tf_regs.reg_eax = 0;
+	e->env_tf.tf_eip = eip;
+	e->env_tf.tf_esp = esp;
+	e->env_xstacktop = xstacktop;
+	e->env_exit_futex = (uint32_t *) exit_futex;
+	ENVSCHED(e)->env_affinity = ENVSCHED(curenv)->env_affinity;
+	// env_alloc left it runnable: get an idle CPU to run it
+	sched_wakeup(e);
+	return e->env_id;
+}
+
+// Restrict envid to the CPUs in 'cpumask', one bit per CPU number.
+// Bits for CPUs that do not exist or were never started are ignored.
+// An environment running on a CPU it is no longer allowed on moves at
+// its next reschedule, which for the caller is right away.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if cpumask leaves no CPU to run on.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	struct Env *e;
+	struct CpuInfo *c;
+	uint32_t usable = 0;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c->cpu_status != CPU_UNUSED)
+			usable |= CPUMASK(c->cpu_id);
+	if (!(cpumask &= usable))
+		return -E_INVAL;
+	ENVSCHED(e)->env_affinity = cpumask;
+	if (ENVSCHED(e)->env_status == ENV_RUNNABLE)
+		sched_wakeup(e);
+	if (e == curenv && !(cpumask & CPUMASK(thiscpu->cpu_id))) {
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		sched_yield();
+	}
+	return 0;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -141,8 +224,13 @@ sys_env_set_status(envid_t envid, int status)
     if (ret < 0 || env == NULL) {
         return ret;
     }
-    // do set status
-    env->env_status = status;
+    // do set status; this overrides any sleep in progress
+    timer_cancel(ENVTIMER(env));
+    futex_cancel(env);
+    ENVSCHED(env)->env_status = status;
+    if (status == ENV_RUNNABLE) {
+        sched_wakeup(env);
+    }
     return 0;
 }
 
@@ -188,9 +276,19 @@ check_user_page_perm(int perm) {
     return 0;
 }
 
+// Does [va, va + npages pages) overlap the kernel's info pages at
+// UVDSO?  Users may not map, unmap or send those.
+static bool
+va_range_vdso(uintptr_t va, size_t npages) {
+    return va < UVDSO + 2 * PGSIZE && va + npages * PGSIZE > UVDSO;
+}
+
 static int
 check_va_bound_round(void *va) {
-    if ((uintptr_t)va > UTOP || (uintptr_t)va % PGSIZE != 0) {
+    if ((uintptr_t)va >= UTOP || (uintptr_t)va % PGSIZE != 0) {
+        return -E_INVAL;
+    }
+    if (va_range_vdso((uintptr_t)va, 1)) {
         return -E_INVAL;
     }
     return 0;
@@ -209,6 +307,7 @@ check_va_bound_round(void *va) {
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if va is one of the info pages at UVDSO.
 //	-E_INVAL if perm is inappropriate (see above).
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
@@ -252,7 +351,7 @@ sys_page_alloc(envid_t envid, void *va, int perm)
         // out of memory
         return -E_NO_MEM;
     }
-    ret = page_insert(env->env_pgdir, phypage, va, perm);
+    ret = env_page_insert(env, phypage, va, perm);
     if (ret < 0) {
         // no memory for new page table
         // must roll back
@@ -274,6 +373,7 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //		or the caller doesn't have permission to change one of them.
 //	-E_INVAL if srcva >= UTOP or srcva is not page-aligned,
 //		or dstva >= UTOP or dstva is not page-aligned.
+//	-E_INVAL if srcva or dstva is one of the info pages at UVDSO.
 //	-E_INVAL is srcva is not mapped in srcenvid's address space.
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
@@ -341,7 +441,7 @@ sys_page_map(envid_t srcenvid, void *srcva,
         }
     }
     // insert mapping to dst
-    ret = page_insert(dstenv->env_pgdir, pp, dstva, perm);
+    ret = env_page_insert(dstenv, pp, dstva, perm);
     if (ret < 0) {
         // no memory for new page table
         return ret;
@@ -357,6 +457,7 @@ sys_page_map(envid_t srcenvid, void *srcva,
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if va is one of the info pages at UVDSO.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -396,13 +497,18 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise;
+//    env_ipc_npages is set to the number of pages transferred.
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
 // sys_ipc_recv function ever actually return?)
 //
 // If the sender wants to send a page but the receiver isn't asking for one,
 // then no page mapping is transferred, but no error occurs.
+//
+// 'npages' consecutive pages starting at 'srcva' are sent, and mapped
+// at consecutive addresses from the receiver's dstva.  If the receiver
+// asked for fewer, only that many are sent.
 // The ipc only happens when no errors occur.
 //
 // Returns 0 on success, < 0 on error.
@@ -414,14 +520,17 @@ sys_page_unmap(envid_t envid, void *va)
 //	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
-//	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
-//		address space.
-//	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
-//		current environment's address space.
-//	-E_NO_MEM if there's not enough memory to map srcva in envid's
+//	-E_INVAL if srcva < UTOP but the page range runs past UTOP.
+//	-E_INVAL if srcva < UTOP but the page range covers UVDSO.
+//	-E_INVAL if srcva < UTOP but a page in the range is not mapped in
+//		the caller's address space.
+//	-E_INVAL if (perm & PTE_W), but a page in the range is read-only
+//		in the current environment's address space.
+//	-E_NO_MEM if there's not enough memory to map the pages in envid's
 //		address space.
 static int
-sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+		 size_t npages)
 {
 	// LAB 4: Your code here.
 	// panic("sys_ipc_try_send not implemented");
@@ -444,7 +553,7 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	    // unwilling to receive a page
 	    perm = 0;
 	}
-    if ((uint32_t)srcva >= UTOP) {
+    if ((uint32_t)srcva >= UTOP || npages == 0) {
         // does not send a page
         perm = 0;
     }
@@ -462,34 +571,34 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
         if (ret < 0) {
             return ret;
         }
-        // check page permissions on this env
-        pte_t *srcpte;
-        struct PageInfo *pp = page_lookup(curenv->env_pgdir, srcva, &srcpte);
-        if (pp == NULL) {
-            // no mapping exists
-            return -E_INVAL;
-        }
-        if ((perm & PTE_W) == PTE_W && (*srcpte & PTE_W) != PTE_W) {
-            // no write permission
+        // validate and map the whole range at once; sends larger
+        // than the receiver asked for are cut short
+        npages = MIN(npages, dstenv->env_ipc_npages);
+        if (npages > (UTOP - (uint32_t)srcva) / PGSIZE
+            || va_range_vdso((uintptr_t)srcva, npages)) {
             return -E_INVAL;
         }
-        // make mapping
-        ret = page_insert(dstenv->env_pgdir, pp, dstenv->env_ipc_dstva, perm);
+        ret = env_page_map_range(dstenv, dstenv->env_ipc_dstva,
+                                 curenv->env_pgdir, srcva, npages, perm);
         if (ret < 0) {
             return ret;
         }
         // no changes made on dstenv so far
         dstenv->env_ipc_perm = perm;
+        dstenv->env_ipc_npages = npages;
 	} else {
 	    // not sending a page
 	    dstenv->env_ipc_perm = 0;
+	    dstenv->env_ipc_npages = 0;
 	}
 	// all error returns above do not change current states on both sides
     // send value
     dstenv->env_ipc_from = curenv->env_id;
     dstenv->env_ipc_value = value;
-    // mark runnable
-    dstenv->env_status = ENV_RUNNABLE;
+    // mark runnable, and get an idle CPU to pick it up
+    timer_cancel(ENVTIMER(dstenv));
+    ENVSCHED(dstenv)->env_status = ENV_RUNNABLE;
+    sched_wakeup(dstenv);
     // reject further sendings
     dstenv->env_ipc_recving = 0;
     // setup dstenv return state
@@ -498,35 +607,82 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
     return 0;
 }
 
+// Timer callback for an environment blocked in sys_sleep or in
+// sys_ipc_recv with a timeout: make it runnable again, failing the
+// receive with -E_TIMEOUT.
+static void
+sys_timeout(struct Timer *t)
+{
+	struct Env *e = &envs[t - envtimer];
+
+	if (ENVSCHED(e)->env_status != ENV_NOT_RUNNABLE)
+		return;
+	if (e->env_ipc_recving) {
+		e->env_ipc_recving = 0;
+		e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+	}
+	ENVSCHED(e)->env_status = ENV_RUNNABLE;
+	sched_wakeup(e);
+}
+
+// Give up the CPU for at least 'msec' milliseconds, or just yield if
+// 'msec' is 0.  The environment is not runnable meanwhile, so it costs
+// no CPU time; it is woken from the timer interrupt.
+// Always returns 0.
+static int
+sys_sleep(uint32_t msec)
+{
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	if (msec == 0)
+		sched_yield();
+	ENVSCHED(curenv)->env_status = ENV_NOT_RUNNABLE;
+	timer_add(ENVTIMER(curenv), time_ns() + msec * 1000000ULL,
+		  sys_timeout);
+	sched_yield();
+}
+
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
 //
-// If 'dstva' is < UTOP, then you are willing to receive a page of data.
-// 'dstva' is the virtual address at which the sent page should be mapped.
+// If 'dstva' is < UTOP, then you are willing to receive up to 'npages'
+// pages of data, mapped at consecutive addresses starting at 'dstva'.
+// If 'msec' is nonzero, give up after that many milliseconds.
 //
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if dstva < UTOP but the npages pages run past UTOP.
+//	-E_INVAL if dstva < UTOP but the npages pages cover UVDSO.
+//	-E_TIMEOUT if nothing arrived within 'msec' milliseconds.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, size_t npages, uint32_t msec)
 {
 	// LAB 4: Your code here.
 	// panic("sys_ipc_recv not implemented");
 	// setup waiting state
-	if ((uint32_t)dstva < UTOP) {
-        curenv->env_ipc_dstva = dstva;
+	if ((uint32_t)dstva < UTOP && npages > 0) {
         if ((uint32_t)dstva % PGSIZE) {
             // not aligned
             return -E_INVAL;
         }
+        if (npages > (UTOP - (uint32_t)dstva) / PGSIZE
+            || va_range_vdso((uintptr_t)dstva, npages)) {
+            return -E_INVAL;
+        }
+        curenv->env_ipc_dstva = dstva;
+        curenv->env_ipc_npages = npages;
     } else {
 	    // reject page transfer
 	    curenv->env_ipc_dstva = (void *)UTOP;
+	    curenv->env_ipc_npages = 0;
 	}
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	ENVSCHED(curenv)->env_status = ENV_NOT_RUNNABLE;
     curenv->env_ipc_recving = 1;
+    if (msec)
+        timer_add(ENVTIMER(curenv), time_ns() + msec * 1000000ULL,
+                  sys_timeout);
 
 //    cprintf("[ipc] CPU %d waiting on ipc\n", thiscpu->cpu_id);
     sched_yield();
@@ -572,9 +728,19 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	        return sys_env_set_pgfault_upcall(a1, (void *)a2);
 
 	    case SYS_ipc_try_send:
-	        return sys_ipc_try_send(a1, a2, (void *)a3, a4);
+	        return sys_ipc_try_send(a1, a2, (void *)a3, a4, a5);
 	    case SYS_ipc_recv:
-            return sys_ipc_recv((void *)a1);
+            return sys_ipc_recv((void *)a1, a2, a3);
+	    case SYS_sleep:
+	        return sys_sleep(a1);
+	    case SYS_futex_wait:
+	        return futex_wait((volatile uint32_t *)a1, a2);
+	    case SYS_futex_wake:
+	        return futex_wake((volatile uint32_t *)a1, a2);
+	    case SYS_thread_create:
+	        return sys_thread_create(a1, a2, a3, a4);
+	    case SYS_env_set_affinity:
+	        return sys_env_set_affinity(a1, a2);
 
         case NSYSCALLS:
         default:
@@ -0,0 +1,114 @@
+// Time keeping and short delays, based on the TSC.
+//
+// The TSC rate is measured once at boot against PIT channel 2, which
+// counts at a fixed 1.193182 MHz on every PC.  The TSC is assumed to
+// be invariant and in step across CPUs, as it is on anything with a
+// LAPIC that QEMU emulates or that is recent enough to matter.
+
+#include <inc/types.h>
+#include <inc/x86.h>
+#include <inc/stdio.h>
+
+#include <kern/time.h>
+
+#define PIT_HZ		1193182
+#define PIT_CH2		0x42		// channel 2 counter
+#define PIT_MODE	0x43		// mode/command register
+#define PIT_PORTB	0x61		// system control port B
+	#define PORTB_GATE2	0x01	// channel 2 gate
+	#define PORTB_SPKR	0x02	// speaker data enable
+	#define PORTB_OUT2	0x20	// channel 2 output (read only)
+
+#define CAL_MS		10		// length of one calibration run
+#define CAL_RUNS	3		// take the least disturbed of these
+
+#define TSC_NS_MULT(khz)	((uint32_t) ((1000000ULL << TSC_NS_SHIFT) / (khz)))
+
+// Until time_init() runs, assume a fast CPU, so that delays err long.
+uint32_t tsc_khz = 4000000;
+uint32_t tsc_ns_mult = TSC_NS_MULT(4000000);
+
+// Count CAL_MS milliseconds on PIT channel 2 and return the number of
+// TSC cycles that took, or 0 if the PIT never reached terminal count.
+static uint64_t
+pit_measure(void)
+{
+	uint32_t count = PIT_HZ * CAL_MS / 1000;
+	uint64_t start, end, limit;
+	uint8_t portb = inb(PIT_PORTB);
+
+	// Gate channel 2 on with the speaker off and start a one-shot
+	// count (mode 0): its output goes high when the count runs out.
+	outb(PIT_PORTB, (portb & ~PORTB_SPKR) | PORTB_GATE2);
+	outb(PIT_MODE, 0xB0);		// channel 2, lo/hi byte, mode 0
+	outb(PIT_CH2, count & 0xFF);
+	outb(PIT_CH2, count >> 8);
+
+	start = end = read_tsc();
+	limit = start + (1ULL << 34);	// seconds, even at several GHz
+	while (!(inb(PIT_PORTB) & PORTB_OUT2) && end < limit)
+		end = read_tsc();
+	outb(PIT_PORTB, portb);
+	return end < limit ? end - start : 0;
+}
+
+void
+time_init(void)
+{
+	uint64_t cycles, best = ~0ULL;
+	int i;
+
+	for (i = 0; i < CAL_RUNS; i++)
+		if ((cycles = pit_measure()) && cycles < best)
+			best = cycles;
+	if (best == ~0ULL) {
+		cprintf("time: PIT calibration failed, assuming %u kHz TSC\n",
+			tsc_khz);
+		return;
+	}
+
+	// best cycles took count/PIT_HZ seconds
+	tsc_khz = best * PIT_HZ / (PIT_HZ * CAL_MS / 1000) / 1000;
+	tsc_ns_mult = TSC_NS_MULT(tsc_khz);
+	cprintf("time: TSC runs at %u kHz\n", tsc_khz);
+}
+
+// Convert a TSC cycle count to nanoseconds, without a 64-bit divide.
+uint64_t
+tsc_to_ns(uint64_t cycles)
+{
+	uint32_t hi = cycles >> 32, lo = cycles;
+
+	return (((uint64_t) hi * tsc_ns_mult) << (32 - TSC_NS_SHIFT))
+		+ (((uint64_t) lo * tsc_ns_mult) >> TSC_NS_SHIFT);
+}
+
+// Monotonic time in nanoseconds since the machine was reset.
+uint64_t
+time_ns(void)
+{
+	return tsc_to_ns(read_tsc());
+}
+
+static void
+tsc_delay(uint64_t cycles)
+{
+	uint64_t end = read_tsc() + cycles;
+
+	while (read_tsc() < end)
+		asm volatile("pause");
+}
+
+// Spin for at least ns nanoseconds.
+void
+ndelay(uint32_t ns)
+{
+	tsc_delay(((uint64_t) ns * tsc_khz + 999999) / 1000000);
+}
+
+// Spin for at least us microseconds.
+void
+udelay(uint32_t us)
+{
+	tsc_delay(((uint64_t) us * tsc_khz + 999) / 1000);
+}
@@ -0,0 +1,23 @@
+#ifndef JOS_KERN_TIME_H
+#define JOS_KERN_TIME_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// TSC frequency in kHz, measured against the PIT by time_init().
+extern uint32_t tsc_khz;
+
+// Nanoseconds are cycles * tsc_ns_mult >> TSC_NS_SHIFT.
+// A shift of 24 keeps the multiplier within 32 bits down to 4 MHz.
+#define TSC_NS_SHIFT	24
+extern uint32_t tsc_ns_mult;
+
+void	time_init(void);
+uint64_t tsc_to_ns(uint64_t cycles);
+uint64_t time_ns(void);
+void	ndelay(uint32_t ns);
+void	udelay(uint32_t us);
+
+#endif	// !JOS_KERN_TIME_H
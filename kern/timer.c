@@ -0,0 +1,176 @@
+// Per-CPU hierarchical timer wheels.
+//
+// Each CPU keeps its timers in TW_LEVELS levels of TW_SIZE slots.
+// Level 0 holds timers due within the next TW_SIZE ticks, one slot per
+// tick; each level above covers TW_SIZE times the span of the one below
+// it, one slot per span of the lower level.  Adding and cancelling a
+// timer is O(1).  As the wheel turns, whenever a level's index wraps to
+// zero the next slot of the level above is cascaded down, so that every
+// timer is eventually moved into the level-0 slot of its own tick.
+//
+// A CPU advances its own wheel from its LAPIC timer interrupt, catching
+// up on however many ticks have passed since the last one.  All timer
+// state is protected by the big kernel lock, which also lets any CPU
+// cancel a timer that sits on another CPU's wheel.
+
+#include <inc/types.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+#include <kern/time.h>
+#include <kern/timer.h>
+
+#define TW_BITS		6
+#define TW_SIZE		(1 << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+#define TW_LEVELS	4		// 2^24 ticks, about 4.9 hours
+
+struct TimerWheel {
+	uint64_t tw_now;		// next tick to process
+	uint32_t tw_count;		// timers on this wheel
+	struct Timer *tw_slots[TW_LEVELS][TW_SIZE];
+};
+
+static struct TimerWheel timer_wheels[NCPU];
+
+uint32_t timer_npending;
+
+static uint64_t
+timer_ticks(void)
+{
+	return time_ns() >> TIMER_SHIFT;
+}
+
+static void
+timer_link(struct Timer **slot, struct Timer *t)
+{
+	t->t_next = *slot;
+	if (t->t_next)
+		t->t_next->t_pprev = &t->t_next;
+	t->t_pprev = slot;
+	*slot = t;
+}
+
+static void
+timer_unlink(struct Timer *t)
+{
+	if (t->t_next)
+		t->t_next->t_pprev = t->t_pprev;
+	*t->t_pprev = t->t_next;
+	t->t_next = NULL;
+	t->t_pprev = NULL;
+}
+
+// Put t in the slot for its expiry time relative to w->tw_now.
+// Timers that are already due go in the current level-0 slot; those
+// beyond the wheel's span park in the top level and are re-sorted
+// when it cascades.
+static void
+wheel_insert(struct TimerWheel *w, struct Timer *t)
+{
+	uint64_t expires = t->t_expires, delta;
+	int level;
+
+	if (expires < w->tw_now)
+		expires = w->tw_now;
+	delta = expires - w->tw_now;
+	for (level = 0; level < TW_LEVELS - 1; level++)
+		if (delta < (1ULL << (TW_BITS * (level + 1))))
+			break;
+	if (delta >= (1ULL << (TW_BITS * TW_LEVELS)))
+		expires = w->tw_now + (1ULL << (TW_BITS * TW_LEVELS)) - 1;
+	timer_link(&w->tw_slots[level][(expires >> (TW_BITS * level)) & TW_MASK],
+		   t);
+}
+
+// Re-sort every timer in one slot of 'level' into the levels below.
+static void
+wheel_cascade(struct TimerWheel *w, int level, int idx)
+{
+	struct Timer *t;
+
+	while ((t = w->tw_slots[level][idx]) != NULL) {
+		timer_unlink(t);
+		wheel_insert(w, t);
+	}
+}
+
+// Start every CPU's wheel at the current time.
+void
+timer_init(void)
+{
+	uint64_t now = timer_ticks();
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		timer_wheels[i].tw_now = now;
+}
+
+// Arm t to call func(t) once time_ns() reaches ns, on this CPU's
+// wheel.  If t is already pending it is moved to the new time.
+// func runs from the timer interrupt, with the big kernel lock held.
+void
+timer_add(struct Timer *t, uint64_t ns, void (*func)(struct Timer *))
+{
+	struct TimerWheel *w = &timer_wheels[thiscpu - cpus];
+
+	timer_cancel(t);
+	// Round up, so that a timer never fires early
+	t->t_expires = (ns + (1 << TIMER_SHIFT) - 1) >> TIMER_SHIFT;
+	t->t_func = func;
+	t->t_cpu = thiscpu - cpus;
+	wheel_insert(w, t);
+	w->tw_count++;
+	timer_npending++;
+}
+
+// Disarm t if it is pending.
+void
+timer_cancel(struct Timer *t)
+{
+	if (!t->t_pprev)
+		return;
+	timer_unlink(t);
+	timer_wheels[t->t_cpu].tw_count--;
+	timer_npending--;
+}
+
+// Advance this CPU's wheel to the present, running every timer that
+// has expired.  Called on each LAPIC timer interrupt.
+void
+timer_tick(void)
+{
+	struct TimerWheel *w = &timer_wheels[thiscpu - cpus];
+	uint64_t now = timer_ticks();
+	struct Timer *t, **slot;
+	int level, idx;
+
+	if (w->tw_count == 0) {
+		if (w->tw_now <= now)
+			w->tw_now = now + 1;
+		return;
+	}
+	while (w->tw_now <= now) {
+		if ((w->tw_now & TW_MASK) == 0)
+			for (level = 1; level < TW_LEVELS; level++) {
+				idx = (w->tw_now >> (TW_BITS * level)) & TW_MASK;
+				wheel_cascade(w, level, idx);
+				if (idx != 0)
+					break;
+			}
+
+		slot = &w->tw_slots[0][w->tw_now & TW_MASK];
+		while ((t = *slot) != NULL) {
+			timer_unlink(t);
+			if (t->t_expires > w->tw_now) {
+				// Parked beyond the wheel's span
+				wheel_insert(w, t);
+				continue;
+			}
+			w->tw_count--;
+			timer_npending--;
+			t->t_func(t);
+		}
+		w->tw_now++;
+	}
+}
@@ -0,0 +1,30 @@
+#ifndef JOS_KERN_TIMER_H
+#define JOS_KERN_TIMER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Timer resolution: one tick of the wheel is 2^TIMER_SHIFT ns, about
+// a millisecond.  Timers are only checked on LAPIC timer interrupts,
+// so in practice they fire on the first interrupt after they expire.
+#define TIMER_SHIFT	20
+
+struct Timer {
+	struct Timer *t_next;
+	struct Timer **t_pprev;		// NULL while the timer is not pending
+	uint64_t t_expires;		// wheel tick at which to fire
+	void (*t_func)(struct Timer *);
+	uint8_t t_cpu;			// wheel the timer is on
+};
+
+// Number of pending timers on all CPUs.
+extern uint32_t timer_npending;
+
+void	timer_init(void);
+void	timer_add(struct Timer *t, uint64_t ns, void (*func)(struct Timer *));
+void	timer_cancel(struct Timer *t);
+void	timer_tick(void);
+
+#endif	// !JOS_KERN_TIMER_H
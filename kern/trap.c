@@ -13,6 +13,10 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/image.h>
+#include <kern/ipi.h>
+#include <kern/timer.h>
+#include <kern/vdso.h>
 
 #include <inc/string.h>
 
@@ -77,6 +81,10 @@ static const char *trapname(int trapno)
 		return "System call";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return irqnames[trapno - IRQ_OFFSET];
+	if (trapno == IRQ_OFFSET + IRQ_RESCHED)
+		return "Reschedule IPI";
+	if (trapno == IRQ_OFFSET + IRQ_CALL)
+		return "Cross-CPU call IPI";
 	return "(unknown trap)";
 }
 
@@ -134,6 +142,8 @@ trap_init(void)
     DECLARE_INTENTRY(irq_spurious, IRQ_SPURIOUS + IRQ_OFFSET, 0)
     DECLARE_INTENTRY(irq_ide, IRQ_IDE + IRQ_OFFSET, 0)
     DECLARE_INTENTRY(irq_error, IRQ_ERROR + IRQ_OFFSET, 0)
+    DECLARE_INTENTRY(irq_resched, IRQ_RESCHED + IRQ_OFFSET, 0)
+    DECLARE_INTENTRY(irq_call, IRQ_CALL + IRQ_OFFSET, 0)
 
     // Per-CPU setup
 	trap_init_percpu();
@@ -284,7 +294,7 @@ trap_exit(struct Trapframe *tf) {
     if ((tf->tf_cs & 3) == 3) {
         cprintf("to user\n");
         // exit to user
-        if (curenv && curenv->env_status == ENV_RUNNING)
+        if (curenv && ENVSCHED(curenv)->env_status == ENV_RUNNING)
             env_run(curenv);
         else
             sched_yield();
@@ -329,6 +339,12 @@ trap_dispatch(struct Trapframe *tf)
         case T_SYSCALL:
             handle_syscall(tf);
             return;
+        case T_DEVICE:
+            if ((tf->tf_cs & 3) == 3) {
+                env_fpu_trap(tf);
+                return;
+            }
+            break;
         default:
 //            cprintf("trap caught! number %u\n", tf->tf_trapno);
             break;
@@ -341,14 +357,22 @@ trap_dispatch(struct Trapframe *tf)
      */
     // Handle clock interrupts. Don't forget to acknowledge the
     // interrupt using lapic_eoi() before calling the scheduler!
+    // A reschedule IPI means some env became runnable while this CPU
+    // was idle, so it is handled exactly like a tick.
     // LAB 4: Your code here.
-    if (trapno == IRQ_OFFSET + IRQ_TIMER) {
+    if (trapno == IRQ_OFFSET + IRQ_TIMER
+        || trapno == IRQ_OFFSET + IRQ_RESCHED) {
         if ((tf->tf_cs & 3) == 3) {
 //            cprintf("[kernel] CPU %d interrupt user envid %d by timer\n", thiscpu->cpu_id, curenv ? curenv->env_id : -1);
-//                curenv->env_status = ENV_RUNNABLE;
+//                ENVSCHED(curenv)->env_status = ENV_RUNNABLE;
         } else {
 //            cprintf("[kernel] CPU %d interrupt by timer when waiting on new env\n", thiscpu->cpu_id);
         }
+        if (trapno == IRQ_OFFSET + IRQ_TIMER) {
+            if (thiscpu == bootcpu)
+                vdso_tick();
+            timer_tick();
+        }
         lapic_eoi();
         sched_yield();
     }
@@ -363,9 +387,28 @@ trap_dispatch(struct Trapframe *tf)
 	}
 }
 
+// Return from a trap straight to the interrupted code, in user or
+// kernel mode, using the trap frame on the kernel stack.  Unlike
+// env_pop_tf this does not need curenv.
+static void __attribute__((noreturn))
+trap_pop_tf(struct Trapframe *tf)
+{
+	asm volatile(
+		"\tmovl %0,%%esp\n"
+		"\tpopal\n"
+		"\tpopl %%es\n"
+		"\tpopl %%ds\n"
+		"\taddl $0x8,%%esp\n" /* skip tf_trapno and tf_errcode */
+		"\tiret\n"
+		: : "g" (tf) : "memory");
+	panic("iret failed");
+}
+
 void
 trap(struct Trapframe *tf)
 {
+	uint64_t tsc;
+
     // The environment may have set DF and some versions
 	// of GCC rely on DF being clear
 	asm volatile("cld" ::: "cc");
@@ -375,6 +418,15 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
+	// Run cross-CPU calls straight away and go back to whatever was
+	// interrupted.  This must not wait for the big kernel lock: its
+	// holder may be the CPU waiting for these calls to finish.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_CALL) {
+		lapic_eoi();
+		ipi_call_poll();
+		trap_pop_tf(tf);
+	}
+
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
 	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
@@ -412,16 +464,19 @@ trap(struct Trapframe *tf)
 		// serious kernel work.
 		// LAB 4: Your code here.
 
+		// User time ends here; time spent spinning on the lock
+		// is kernel time, charged from tsc onwards.
+		tsc = read_tsc();
 		lock_kernel();
 
 		assert(curenv);
+		curenv->env_utime += tsc - curenv->env_tstamp;
+		curenv->env_tstamp = tsc;
 
 		// Garbage collect if current enviroment is a zombie
-		if (curenv->env_status == ENV_DYING) {
+		if (ENVSCHED(curenv)->env_status == ENV_DYING) {
 //		    cprintf("[kernel] CPU %d collecting dying envid %08x\n", thiscpu->cpu_id, curenv->env_id);
-			env_free(curenv);
-			curenv = NULL;
-			sched_yield();
+			env_destroy(curenv);
 		}
 
 		// Copy trap frame (which is currently on the stack)
@@ -443,14 +498,15 @@ trap(struct Trapframe *tf)
 	// scheduled, so we should return to the current environment
 	// if doing so makes sense.
 //	trap_exit(tf);
-    if (curenv && curenv->env_status == ENV_RUNNING)
+    if (curenv && ENVSCHED(curenv)->env_status == ENV_RUNNING)
         env_run(curenv);
     else
         sched_yield();
 }
 
 static int va_in_exceptionstack(void *va) {
-    return (uint32_t)va <= UXSTACKTOP && (uint32_t)va > UXSTACKTOP - PGSIZE;
+    uintptr_t top = curenv->env_xstacktop;
+    return (uint32_t)va <= top && (uint32_t)va > top - PGSIZE;
 }
 
 static void page_fault_exit(uint32_t fault_va, struct Trapframe *tf) {
@@ -484,9 +540,16 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// First touch of a page of a demand-paged program image:
+	// populate it and restart the faulting instruction.
+	if (!(tf->tf_err & FEC_PR) && curenv->env_image
+	    && image_map_page(curenv, curenv->env_image, fault_va) == 0)
+		return;
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
-	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
+	// curenv->env_xstacktop, which is UXSTACKTOP except in threads),
+	// then branch to curenv->env_pgfault_upcall.
 	//
 	// The page fault upcall might cause another page fault, in which case
 	// we branch to the page fault upcall recursively, pushing another
@@ -515,6 +578,7 @@ page_fault_handler(struct Trapframe *tf)
 
 	// LAB 4: Your code here.
 	int ret;
+	uintptr_t xtop = curenv->env_xstacktop;
 
     // check user permissions
     /*
@@ -530,7 +594,7 @@ page_fault_handler(struct Trapframe *tf)
         page_fault_exit(fault_va, tf);
         return;
     }
-    if (tf->tf_esp > USTACKTOP && tf->tf_esp <= UXSTACKTOP - PGSIZE) {
+    if (tf->tf_esp > xtop - 2 * PGSIZE && tf->tf_esp <= xtop - PGSIZE) {
         // exception stack out of space
         page_fault_exit(fault_va, tf);
         return;
@@ -543,12 +607,12 @@ page_fault_handler(struct Trapframe *tf)
 //    envtf->tf_esp -= 4;
 //    *(uint32_t *)envtf->tf_esp = envtf->tf_eip;
     struct UTrapframe *utf = NULL;
-    if (tf->tf_esp < UXSTACKTOP && tf->tf_esp >= UXSTACKTOP - PGSIZE) {
+    if (tf->tf_esp < xtop && tf->tf_esp >= xtop - PGSIZE) {
         // must leave empty word for recursive faults
         utf = (struct UTrapframe *)(tf->tf_esp - sizeof(struct UTrapframe) - 4);
     } else {
         // not recursive faults
-        utf = (struct UTrapframe *)(UXSTACKTOP - sizeof(struct UTrapframe));
+        utf = (struct UTrapframe *)(xtop - sizeof(struct UTrapframe));
     }
 //    cprintf(" [%s, %s, %s]\n",
 //            utf->utf_err & 4 ? "user" : "kernel",
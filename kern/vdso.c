@@ -0,0 +1,106 @@
+/* See COPYRIGHT for copyright information. */
+
+// The read-only info pages mapped at UVDSO in every environment.
+//
+// The time page is allocated once and shared.  Its TSC scale is fixed
+// at boot, and the boot CPU bumps its tick count on every timer
+// interrupt.  Each new address space gets its own env page, which
+// env_run() fills in with the env it is about to run and the CPU.
+// Both pages sit below UTEXT, where fork() does not copy, so a child
+// keeps the pages the kernel gave it, and the page system calls refuse
+// to touch them.  The kernel still only ever writes the env page
+// through env_vdso, on which it holds a reference of its own, never
+// through whatever the env's page table maps.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/memlayout.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/time.h>
+#include <kern/vdso.h>
+
+static struct PageInfo *vdso_time_page;
+static struct VdsoTime *vdso_time;
+
+// Allocate and fill in the shared time page.  Call after time_init()
+// and mem_init().
+void
+vdso_init(void)
+{
+	static_assert(sizeof(struct VdsoTime) <= PGSIZE);
+	static_assert(sizeof(struct VdsoEnv) <= PGSIZE);
+
+	if (!(vdso_time_page = page_alloc(ALLOC_ZERO)))
+		panic("vdso_init: out of memory");
+	vdso_time_page->pp_ref++;	// never freed
+	vdso_time = page2kva(vdso_time_page);
+	vdso_time->vt_tsc_khz = tsc_khz;
+	vdso_time->vt_tsc_ns_mult = tsc_ns_mult;
+	vdso_time->vt_tsc_ns_shift = TSC_NS_SHIFT;
+}
+
+// Map the shared time page and a fresh env page into e's new address
+// space.  Returns 0, or -E_NO_MEM.  On error some of the mappings may
+// have been made, to be torn down with the rest of e's address space.
+int
+vdso_map(struct Env *e)
+{
+	struct PageInfo *pp;
+	int r;
+
+	e->env_vdso = NULL;
+	if ((r = env_page_insert(e, vdso_time_page, (void *) UVDSO,
+				 PTE_U | PTE_P)) < 0)
+		return r;
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	if ((r = env_page_insert(e, pp, (void *) (UVDSO + PGSIZE),
+				 PTE_U | PTE_P)) < 0) {
+		page_free(pp);
+		return r;
+	}
+	pp->pp_ref++;
+	e->env_vdso = pp;
+	return 0;
+}
+
+// Make e, a new thread, share parent's env page.
+void
+vdso_share(struct Env *e, struct Env *parent)
+{
+	vdso_release(e);
+	if ((e->env_vdso = parent->env_vdso) != NULL)
+		e->env_vdso->pp_ref++;
+}
+
+// Drop e's reference to its env page.
+void
+vdso_release(struct Env *e)
+{
+	if (e->env_vdso) {
+		page_decref(e->env_vdso);
+		e->env_vdso = NULL;
+	}
+}
+
+// Record that e is about to run on this CPU.  Called by env_run().
+void
+vdso_run(struct Env *e)
+{
+	struct VdsoEnv *ve;
+
+	if (!e->env_vdso)
+		return;
+	ve = page2kva(e->env_vdso);
+	ve->ve_envid = e->env_id;
+	ve->ve_cpunum = thiscpu->cpu_id;
+}
+
+// Count a timer interrupt.  Called on the boot CPU only.
+void
+vdso_tick(void)
+{
+	vdso_time->vt_ticks++;
+}
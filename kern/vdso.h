@@ -0,0 +1,18 @@
+#ifndef JOS_KERN_VDSO_H
+#define JOS_KERN_VDSO_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/vdso.h>
+
+struct Env;
+
+void	vdso_init(void);
+int	vdso_map(struct Env *e);
+void	vdso_share(struct Env *e, struct Env *parent);
+void	vdso_release(struct Env *e);
+void	vdso_run(struct Env *e);
+void	vdso_tick(void);
+
+#endif	// !JOS_KERN_VDSO_H
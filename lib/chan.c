@@ -0,0 +1,204 @@
+// One-way byte channels between two environments over a shared page.
+//
+// A channel is a ring buffer in a single page that the writer allocates
+// and hands to the reader once, with IPC.  Data then moves through
+// plain loads and stores: the only system calls are wakeups, made when
+// one side finds the ring empty (reader) or full (writer) and has to
+// block until the other side makes progress.
+//
+// Blocking is done with a futex on the waiting side's flag in the
+// shared page, so channels leave the environment's IPC slot alone and
+// can be mixed freely with plain IPC.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// Value of the IPC that hands a new channel page to its reader.
+#define CHAN_MAGIC	0x4348414e	// "CHAN"
+
+#define CHAN_BUFSIZE	2048		// power of two, fits in the page
+
+struct Chan {
+	// Free-running byte counts: ch_tail - ch_head bytes are buffered.
+	// Each is written by one side only, and they live in separate
+	// cache lines so the two sides do not contend for one line.
+	volatile uint32_t ch_tail;	// produced, written by the writer
+	volatile uint32_t ch_wwait;	// writer is blocked on a full ring
+	uint8_t ch_pad0[56];
+	volatile uint32_t ch_head;	// consumed, written by the reader
+	volatile uint32_t ch_rwait;	// reader is blocked on an empty ring
+	uint8_t ch_pad1[56];
+	volatile uint32_t ch_closed;	// either side has closed
+	envid_t ch_writer;
+	envid_t ch_reader;
+	uint8_t ch_pad2[52];
+	uint8_t ch_buf[CHAN_BUFSIZE];
+};
+
+// Full barrier: orders our store to ch_tail or ch_head before the load
+// of the peer's wait flag that follows it.  A locked instruction is a
+// full barrier on every x86, unlike mfence which needs SSE2.
+static inline void
+chan_mb(void)
+{
+	asm volatile("lock; addl $0,0(%%esp)" : : : "cc", "memory");
+}
+
+// Wake the side blocked (or about to block) in chan_wait on *flag.
+// The caller has just cleared *flag.
+static void
+chan_wake(volatile uint32_t *flag)
+{
+	sys_futex_wake(flag, 1);
+}
+
+// Block until ready(c) holds, setting *flag to ask the peer for a
+// wakeup.  The peer clears the flag before it wakes us, so the futex
+// wait returns at once if the wakeup came between our last look at
+// ready(c) and going to sleep.  A wakeup that finds nobody asleep is
+// simply dropped: the loop looks at ready(c) again either way.
+static void
+chan_wait(struct Chan *c, volatile uint32_t *flag,
+	  bool (*ready)(struct Chan *))
+{
+	while (!ready(c)) {
+		xchg(flag, 1);
+		if (ready(c)) {
+			xchg(flag, 0);
+			return;
+		}
+		sys_futex_wait(flag, 1);
+	}
+}
+
+static bool
+chan_readable(struct Chan *c)
+{
+	return c->ch_tail != c->ch_head || c->ch_closed;
+}
+
+static bool
+chan_writable(struct Chan *c)
+{
+	return c->ch_tail - c->ch_head < CHAN_BUFSIZE || c->ch_closed;
+}
+
+// Create a channel to 'reader', mapping its page at 'va' in our address
+// space, and hand it to the reader, which must call chan_accept.
+// Returns 0 on success and stores the channel in *chanp, < 0 on error.
+int
+chan_create(envid_t reader, void *va, struct Chan **chanp)
+{
+	struct Chan *c = va;
+	int r;
+
+	static_assert(sizeof(struct Chan) <= PGSIZE);
+
+	if ((r = sys_page_alloc(0, va, PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0)
+		return r;
+	c->ch_writer = thisenv->env_id;
+	c->ch_reader = reader;
+	ipc_send(reader, CHAN_MAGIC, va, PTE_P | PTE_U | PTE_W | PTE_SHARE);
+	*chanp = c;
+	return 0;
+}
+
+// Accept a channel created for us with chan_create, mapping its page
+// at 'va'.  Returns 0 on success and stores the channel in *chanp,
+// -E_INVAL if the IPC received was not a channel.
+int
+chan_accept(void *va, struct Chan **chanp)
+{
+	struct Chan *c = va;
+	envid_t from;
+	int perm;
+	int32_t r;
+
+	r = ipc_recv(&from, va, &perm);
+	if (r < 0)
+		return r;
+	if (r != CHAN_MAGIC || !(perm & PTE_W) || c->ch_writer != from)
+		return -E_INVAL;
+	*chanp = c;
+	return 0;
+}
+
+// Write all n bytes of buf to c, blocking while the ring is full.
+// Returns n, or -E_EOF if the channel was closed.
+ssize_t
+chan_write(struct Chan *c, const void *buf, size_t n)
+{
+	const uint8_t *p = buf;
+	uint32_t tail, off;
+	size_t m, done;
+
+	for (done = 0; done < n; done += m) {
+		chan_wait(c, &c->ch_wwait, chan_writable);
+		if (c->ch_closed)
+			return -E_EOF;
+		tail = c->ch_tail;
+		m = MIN(n - done, CHAN_BUFSIZE - (tail - c->ch_head));
+		off = tail % CHAN_BUFSIZE;
+		if (off + m <= CHAN_BUFSIZE)
+			memcpy(&c->ch_buf[off], p + done, m);
+		else {
+			memcpy(&c->ch_buf[off], p + done, CHAN_BUFSIZE - off);
+			memcpy(c->ch_buf, p + done + CHAN_BUFSIZE - off,
+			       m - (CHAN_BUFSIZE - off));
+		}
+		// x86 does not reorder stores, so once the compiler is kept
+		// from doing so the data is visible before the new tail.
+		asm volatile("" : : : "memory");
+		c->ch_tail = tail + m;
+		chan_mb();
+		if (c->ch_rwait && xchg(&c->ch_rwait, 0))
+			chan_wake(&c->ch_rwait);
+	}
+	return n;
+}
+
+// Read up to n bytes from c into buf, blocking until at least one is
+// available.  Returns the number of bytes read, or 0 once the channel
+// has been closed and drained.
+ssize_t
+chan_read(struct Chan *c, void *buf, size_t n)
+{
+	uint8_t *p = buf;
+	uint32_t head, off;
+	size_t m;
+
+	if (n == 0)
+		return 0;
+	chan_wait(c, &c->ch_rwait, chan_readable);
+	head = c->ch_head;
+	m = MIN(n, c->ch_tail - head);
+	if (m == 0)
+		return 0;
+	off = head % CHAN_BUFSIZE;
+	if (off + m <= CHAN_BUFSIZE)
+		memcpy(p, &c->ch_buf[off], m);
+	else {
+		memcpy(p, &c->ch_buf[off], CHAN_BUFSIZE - off);
+		memcpy(p + CHAN_BUFSIZE - off, c->ch_buf,
+		       m - (CHAN_BUFSIZE - off));
+	}
+	asm volatile("" : : : "memory");
+	c->ch_head = head + m;
+	chan_mb();
+	if (c->ch_wwait && xchg(&c->ch_wwait, 0))
+		chan_wake(&c->ch_wwait);
+	return m;
+}
+
+// Close c.  The reader sees end of file once it has read everything
+// written before the close; later writes fail with -E_EOF.
+void
+chan_close(struct Chan *c)
+{
+	c->ch_closed = 1;
+	chan_mb();
+	if (c->ch_rwait && xchg(&c->ch_rwait, 0))
+		chan_wake(&c->ch_rwait);
+	if (c->ch_wwait && xchg(&c->ch_wwait, 0))
+		chan_wake(&c->ch_wwait);
+}
@@ -0,0 +1,484 @@
+// Fibers: cooperative user-level threads multiplexed onto a few kernel
+// threads (M:N).
+//
+// A fiber is little more than a one-page stack and a saved stack
+// pointer, so creating one costs a slot from a free list (and, the
+// first time a slot is used, one sys_page_alloc), and switching between
+// two costs a few instructions in fiber_switch, without entering the
+// kernel.  fiber_run starts worker threads (lib/thread.c), typically
+// one per CPU, that take runnable fibers off a shared run queue and run
+// each until it yields, blocks or exits; idle workers sleep on a futex.
+//
+// Only the calling fiber blocks in fiber_ipc_recv and fiber_ipc_accept.
+// While fibers run, the thread that called fiber_run does all of the
+// environment's IPC receiving, and routes each message to the fiber
+// waiting for its sender, or else to a fiber waiting for anyone, or
+// else queues it until one asks.  While FIBER_MSGQ messages are queued
+// the pump stops receiving, so senders wait in their send loops until
+// a fiber takes one, rather than have messages dropped.  Peers address
+// the whole fiber program by the envid of the thread that called
+// fiber_run.  Messages a fiber sends come from its worker thread, which
+// never receives, so peers must not reply to their sender.
+// Only values are routed; page transfers are not supported.
+//
+// Fibers run on their own stacks, so within a fiber 'thisenv' is the
+// main thread's, and ipc_recv must not be used.  Fibers do not
+// preempt each other: one that computes for long should fiber_yield.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define UFIBERS		0xC0000000	// Fiber stack slots
+#define FIBER_MAX	4096
+#define FIBER_SLOT	(2 * PGSIZE)	// unmapped guard page, then stack
+#define FIBER_WORKERS	8		// Most worker threads
+#define FIBER_IPC_HASH	64		// Buckets of fibers awaiting a peer
+#define FIBER_MSGQ	256		// Messages queued for no fiber yet
+
+enum {
+	FIBER_FREE = 0,
+	FIBER_RUNNABLE,
+	FIBER_RUNNING,
+	FIBER_BLOCKED,
+	FIBER_EXITED
+};
+
+struct Worker;
+
+struct Fiber {
+	uint32_t f_esp;			// Saved stack pointer, while switched out
+	struct Fiber *f_next;		// Run queue, free list or IPC wait list
+	struct Worker *f_worker;	// Worker running the fiber
+	int f_state;
+	bool f_mapped;			// Stack page has been allocated
+	void (*f_fn)(void *);
+	void *f_arg;
+	envid_t f_peer;			// Sender awaited in fiber_ipc_recv
+	envid_t f_ipc_from;		// Message delivered to the fiber
+	uint32_t f_ipc_value;
+};
+
+struct Worker {
+	uint32_t w_esp;			// Scheduler context, while a fiber runs
+	struct Mutex *w_unlock;		// Release once the fiber is off its stack
+	envid_t w_id;
+};
+
+struct Message {
+	envid_t m_from;
+	uint32_t m_value;
+};
+
+static struct Fiber fibers[FIBER_MAX];
+static struct Worker workers[FIBER_WORKERS];
+static int nworkers;
+static envid_t fiber_pump;		// Thread receiving IPC for the fibers
+
+// Run queue and fiber bookkeeping, under fiber_lock
+static struct Mutex fiber_lock;
+static struct Fiber *runq_head, *runq_tail;
+static struct Fiber *fiber_free_list;
+static uint32_t fiber_unused;		// fibers[fiber_unused...] never used
+static uint32_t fiber_count;		// Fibers not yet exited
+static uint32_t idle_workers;
+static volatile uint32_t runq_seq;	// Idle workers sleep on this
+static volatile bool fiber_done;
+
+// IPC routing, under ipc_lock
+static struct Mutex ipc_lock;
+static struct Fiber *ipc_waiters[FIBER_IPC_HASH];
+static struct Fiber *ipc_acceptors;
+static struct Message ipc_msgs[FIBER_MSGQ];
+static uint32_t ipc_msg_head, ipc_msg_tail;
+static struct Cond ipc_space;		// Signalled when ipc_msgs has room
+
+void	fiber_switch(uint32_t *save_esp, uint32_t esp);
+
+// The fiber running on this stack, or NULL outside fibers.
+static struct Fiber *
+fiber_self(void)
+{
+	uintptr_t esp = read_esp();
+
+	if (esp - UFIBERS >= FIBER_MAX * FIBER_SLOT)
+		return NULL;
+	return &fibers[(esp - UFIBERS) / FIBER_SLOT];
+}
+
+// Queue f to run, and wake an idle worker to run it.
+static void
+runq_push(struct Fiber *f)
+{
+	bool wake;
+
+	mutex_lock(&fiber_lock);
+	f->f_state = FIBER_RUNNABLE;
+	f->f_next = NULL;
+	if (runq_tail)
+		runq_tail->f_next = f;
+	else
+		runq_head = f;
+	runq_tail = f;
+	runq_seq++;
+	wake = idle_workers > 0;
+	mutex_unlock(&fiber_lock);
+	if (wake)
+		sys_futex_wake(&runq_seq, 1);
+}
+
+// Take the next runnable fiber, sleeping while there is none.
+// Returns NULL once every fiber has exited.
+static struct Fiber *
+runq_pop(void)
+{
+	struct Fiber *f;
+	uint32_t seq;
+
+	mutex_lock(&fiber_lock);
+	while (!runq_head && !fiber_done) {
+		seq = runq_seq;
+		idle_workers++;
+		mutex_unlock(&fiber_lock);
+		sys_futex_wait(&runq_seq, seq);
+		mutex_lock(&fiber_lock);
+		idle_workers--;
+	}
+	if ((f = runq_head) != NULL) {
+		runq_head = f->f_next;
+		if (!runq_head)
+			runq_tail = NULL;
+	}
+	mutex_unlock(&fiber_lock);
+	return f;
+}
+
+// Return an exited fiber's slot to the free list.  When the last fiber
+// is gone, stop the workers and tell the IPC pump in fiber_run.
+static void
+fiber_release(struct Fiber *f)
+{
+	bool last;
+
+	mutex_lock(&fiber_lock);
+	f->f_state = FIBER_FREE;
+	f->f_next = fiber_free_list;
+	fiber_free_list = f;
+	if ((last = (--fiber_count == 0))) {
+		fiber_done = 1;
+		runq_seq++;
+	}
+	mutex_unlock(&fiber_lock);
+	if (last) {
+		sys_futex_wake(&runq_seq, ~0U);
+		// The pump may be waiting for room in a full queue
+		mutex_lock(&ipc_lock);
+		cond_signal(&ipc_space);
+		mutex_unlock(&ipc_lock);
+		ipc_send(fiber_pump, 0, 0, 0);
+	}
+}
+
+static void
+worker_main(void *arg)
+{
+	struct Worker *w = arg;
+	struct Fiber *f;
+	int state;
+
+	while ((f = runq_pop()) != NULL) {
+		f->f_worker = w;
+		f->f_state = FIBER_RUNNING;
+		fiber_switch(&w->w_esp, f->f_esp);
+
+		// f is off its stack now.  Once w_unlock is released, a
+		// blocked f may be woken and picked up by another worker,
+		// so read its state first.
+		state = f->f_state;
+		if (w->w_unlock) {
+			mutex_unlock(w->w_unlock);
+			w->w_unlock = NULL;
+		}
+		if (state == FIBER_RUNNABLE)
+			runq_push(f);
+		else if (state == FIBER_EXITED)
+			fiber_release(f);
+	}
+}
+
+// Switch from fiber f back to its worker, which releases 'unlock' (if
+// not NULL) once f's context is saved.  Returns when f next runs.
+static void
+fiber_switch_out(struct Fiber *f, struct Mutex *unlock)
+{
+	struct Worker *w = f->f_worker;
+
+	w->w_unlock = unlock;
+	fiber_switch(&f->f_esp, w->w_esp);
+}
+
+static void
+fiber_start(void)
+{
+	struct Fiber *f = fiber_self();
+
+	f->f_fn(f->f_arg);
+	fiber_exit();
+}
+
+// Create a fiber that will run fn(arg) once fiber_run starts (or, if
+// fibers are running, as soon as a worker is free).
+// Returns 0 on success, < 0 on error:
+//	-E_NO_FREE_ENV if FIBER_MAX fibers exist.
+//	-E_NO_MEM if its stack could not be allocated.
+int
+fiber_create(void (*fn)(void *), void *arg)
+{
+	struct Fiber *f;
+	uint32_t *sp;
+	uintptr_t stack;
+	int r;
+
+	mutex_lock(&fiber_lock);
+	if ((f = fiber_free_list) != NULL)
+		fiber_free_list = f->f_next;
+	else if (fiber_unused < FIBER_MAX)
+		f = &fibers[fiber_unused++];
+	if (f)
+		fiber_count++;
+	mutex_unlock(&fiber_lock);
+	if (!f)
+		return -E_NO_FREE_ENV;
+
+	stack = UFIBERS + (f - fibers) * FIBER_SLOT + FIBER_SLOT - PGSIZE;
+	if (!f->f_mapped) {
+		if ((r = sys_page_alloc(0, (void *) stack,
+					PTE_P | PTE_U | PTE_W)) < 0) {
+			mutex_lock(&fiber_lock);
+			f->f_next = fiber_free_list;
+			fiber_free_list = f;
+			fiber_count--;
+			mutex_unlock(&fiber_lock);
+			return r;
+		}
+		f->f_mapped = 1;
+	}
+
+	// The initial context, for fiber_switch to return into
+	sp = (uint32_t *) (stack + PGSIZE);
+	*--sp = 0;			// fiber_start's return address
+	*--sp = (uint32_t) fiber_start;
+	*--sp = 0;			// ebp
+	*--sp = 0;			// ebx
+	*--sp = 0;			// esi
+	*--sp = 0;			// edi
+	f->f_esp = (uint32_t) sp;
+	f->f_fn = fn;
+	f->f_arg = arg;
+	runq_push(f);
+	return 0;
+}
+
+// Let other fibers run.  Outside a fiber, yields the CPU instead.
+void
+fiber_yield(void)
+{
+	struct Fiber *f = fiber_self();
+
+	if (!f) {
+		sys_yield();
+		return;
+	}
+	f->f_state = FIBER_RUNNABLE;
+	fiber_switch_out(f, NULL);
+}
+
+// End the calling fiber.
+void
+fiber_exit(void)
+{
+	struct Fiber *f = fiber_self();
+
+	if (!f)
+		panic("fiber_exit: not in a fiber");
+	f->f_state = FIBER_EXITED;
+	fiber_switch_out(f, NULL);
+	panic("fiber_exit: exited fiber resumed");
+}
+
+// Hand a message to the fiber awaiting it, or queue it.
+// Returns 0 on success, -E_NO_MEM if the queue is full.
+static int
+fiber_ipc_route(envid_t from, uint32_t value)
+{
+	struct Fiber *f, **pf;
+
+	mutex_lock(&ipc_lock);
+	for (pf = &ipc_waiters[ENVX(from) % FIBER_IPC_HASH]; (f = *pf);
+	     pf = &f->f_next)
+		if (f->f_peer == from) {
+			*pf = f->f_next;
+			goto deliver;
+		}
+	if ((f = ipc_acceptors) != NULL) {
+		ipc_acceptors = f->f_next;
+		goto deliver;
+	}
+	// fiber_run only receives into a full queue once every fiber
+	// has exited and nobody is left to take the message.
+	if (ipc_msg_tail - ipc_msg_head == FIBER_MSGQ) {
+		mutex_unlock(&ipc_lock);
+		return -E_NO_MEM;
+	}
+	ipc_msgs[ipc_msg_tail % FIBER_MSGQ].m_from = from;
+	ipc_msgs[ipc_msg_tail % FIBER_MSGQ].m_value = value;
+	ipc_msg_tail++;
+	mutex_unlock(&ipc_lock);
+	return 0;
+
+deliver:
+	f->f_ipc_from = from;
+	f->f_ipc_value = value;
+	runq_push(f);
+	mutex_unlock(&ipc_lock);
+	return 0;
+}
+
+// Note that a queued message has been taken.  Call with ipc_lock held,
+// before updating ipc_msg_head or ipc_msg_tail.
+static void
+ipc_msg_taken(void)
+{
+	if (ipc_msg_tail - ipc_msg_head == FIBER_MSGQ)
+		cond_signal(&ipc_space);
+}
+
+// Wait for the next IPC value from 'from', blocking only this fiber.
+int32_t
+fiber_ipc_recv(envid_t from)
+{
+	struct Fiber *f = fiber_self(), **pf;
+	struct Message *m;
+	uint32_t i, value;
+
+	if (!f)
+		panic("fiber_ipc_recv: not in a fiber");
+	mutex_lock(&ipc_lock);
+	for (i = ipc_msg_head; i != ipc_msg_tail; i++) {
+		m = &ipc_msgs[i % FIBER_MSGQ];
+		if (m->m_from != from)
+			continue;
+		value = m->m_value;
+		ipc_msg_taken();
+		for (; i + 1 != ipc_msg_tail; i++)
+			ipc_msgs[i % FIBER_MSGQ] = ipc_msgs[(i + 1) % FIBER_MSGQ];
+		ipc_msg_tail--;
+		mutex_unlock(&ipc_lock);
+		return value;
+	}
+
+	// Wait in line behind any other fibers waiting for 'from'
+	f->f_peer = from;
+	f->f_next = NULL;
+	for (pf = &ipc_waiters[ENVX(from) % FIBER_IPC_HASH]; *pf;
+	     pf = &(*pf)->f_next)
+		;
+	*pf = f;
+	f->f_state = FIBER_BLOCKED;
+	fiber_switch_out(f, &ipc_lock);
+	return f->f_ipc_value;
+}
+
+// Wait for an IPC value that no fiber is waiting for in particular,
+// storing its sender in *from_store, and blocking only this fiber.
+int32_t
+fiber_ipc_accept(envid_t *from_store)
+{
+	struct Fiber *f = fiber_self();
+	struct Message *m;
+	uint32_t value;
+
+	if (!f)
+		panic("fiber_ipc_accept: not in a fiber");
+	mutex_lock(&ipc_lock);
+	if (ipc_msg_head != ipc_msg_tail) {
+		ipc_msg_taken();
+		m = &ipc_msgs[ipc_msg_head++ % FIBER_MSGQ];
+		*from_store = m->m_from;
+		value = m->m_value;
+		mutex_unlock(&ipc_lock);
+		return value;
+	}
+	f->f_next = ipc_acceptors;
+	ipc_acceptors = f;
+	f->f_state = FIBER_BLOCKED;
+	fiber_switch_out(f, &ipc_lock);
+	*from_store = f->f_ipc_from;
+	return f->f_ipc_value;
+}
+
+// Send 'value' to 'to', letting other fibers run while 'to' is not
+// receiving.  Returns 0 on success, < 0 on error as sys_ipc_try_send.
+int
+fiber_ipc_send(envid_t to, uint32_t value)
+{
+	int r;
+
+	while ((r = sys_ipc_try_send(to, value, 0, 0)) == -E_IPC_NOT_RECV)
+		fiber_yield();
+	return r;
+}
+
+static bool
+fiber_is_worker(envid_t id)
+{
+	int i;
+
+	for (i = 0; i < nworkers; i++)
+		if (workers[i].w_id == id)
+			return 1;
+	return 0;
+}
+
+// Run the fibers created so far, and any they create, on 'n' worker
+// threads, until all of them have exited.  Meanwhile the calling
+// thread receives IPC on the fibers' behalf.
+// Returns 0, or < 0 if no worker thread could be started.
+int
+fiber_run(int n)
+{
+	envid_t from;
+	uint32_t value;
+	int r;
+
+	if (fiber_count == 0)
+		return 0;
+	n = MAX(1, MIN(n, FIBER_WORKERS));
+	fiber_done = 0;
+	fiber_pump = thisenv->env_id;
+	for (nworkers = 0; nworkers < n; nworkers++)
+		if ((workers[nworkers].w_id =
+		     thread_create(worker_main, &workers[nworkers])) < 0) {
+			if (nworkers == 0)
+				return workers[0].w_id;
+			break;
+		}
+
+	// The worker that releases the last fiber sends us a final
+	// message once fiber_done is set.
+	for (;;) {
+		mutex_lock(&ipc_lock);
+		while (ipc_msg_tail - ipc_msg_head == FIBER_MSGQ && !fiber_done)
+			cond_wait(&ipc_space, &ipc_lock);
+		mutex_unlock(&ipc_lock);
+		value = ipc_recv(&from, 0, 0);
+		if (fiber_done && fiber_is_worker(from))
+			break;
+		if ((r = fiber_ipc_route(from, value)) < 0)
+			cprintf("fiber_run: dropped IPC %u from %08x: %e\n",
+				value, from, r);
+	}
+
+	while (nworkers > 0)
+		thread_join(workers[--nworkers].w_id);
+	return 0;
+}
@@ -76,7 +76,7 @@ pgfault(struct UTrapframe *utf)
     // compute page begin
     addr = ROUNDDOWN(addr, 4096);
     // make copy
-    memmove(PFTEMP, (void *)addr, PGSIZE);
+    copy_page(PFTEMP, (void *)addr);
     // map the page to target
 //    ret = sys_page_map(thisenv->env_id, PFTEMP, thisenv->env_id, (void *)addr, perm);
     ret = sys_page_map(0, PFTEMP, 0, (void *)addr, perm);
@@ -125,6 +125,10 @@ duppage(envid_t envid, unsigned pn)
 	if ((perm & PTE_U) == 0 || (perm & PTE_P) == 0) {
 	    return -E_INVAL;
 	}
+	if (perm & PTE_SHARE) {
+	    // shared page (such as a channel): the child maps the same page
+	    return sys_page_map(0, pva, envid, pva, perm & PTE_SYSCALL);
+	}
 	if ((perm & PTE_W) || (perm & PTE_COW)) {
 	    // writable or cow page
 	    ret = sys_page_map(thisenv->env_id, pva, envid, pva, PTE_COW | PTE_U | PTE_P);
@@ -175,7 +179,7 @@ fork(void)
 	envid_t newid = sys_exofork();
 	if (newid == 0) {
 	    // child process
-	    envid_t childid = sys_getenvid();
+	    envid_t childid = vdso_envid();
 	    thisenv = &envs[ENVX(childid)];
 //	    cprintf("child envid [%08x]\n", childid);
 	    // this return is for the child
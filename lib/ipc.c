@@ -2,6 +2,9 @@
 
 #include <inc/lib.h>
 
+static int32_t ipc_recv_common(envid_t *from_env_store, void *pg,
+			       size_t *npages, int *perm_store, unsigned msec);
+
 // Receive a value via IPC and return it.
 // If 'pg' is nonnull, then any page sent by the sender will be mapped at
 //	that address.
@@ -21,6 +24,36 @@
 //   a perfectly valid place to map a page.)
 int32_t
 ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
+{
+	size_t npages = 1;
+
+	return ipc_recv_pages(from_env_store, pg, &npages, perm_store);
+}
+
+// Like ipc_recv, but willing to receive up to *npages pages, mapped
+// at consecutive addresses from 'pg'.  Stores the number of pages
+// actually received in *npages (0 on error or if none were sent).
+int32_t
+ipc_recv_pages(envid_t *from_env_store, void *pg, size_t *npages,
+	       int *perm_store)
+{
+	return ipc_recv_common(from_env_store, pg, npages, perm_store, 0);
+}
+
+// Like ipc_recv, but give up and return -E_TIMEOUT if nothing arrives
+// within 'msec' milliseconds (0 means wait forever).
+int32_t
+ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+		 unsigned msec)
+{
+	size_t npages = 1;
+
+	return ipc_recv_common(from_env_store, pg, &npages, perm_store, msec);
+}
+
+static int32_t
+ipc_recv_common(envid_t *from_env_store, void *pg, size_t *npages,
+		int *perm_store, unsigned msec)
 {
 	// LAB 4: Your code here.
 	//panic("ipc_recv not implemented");
@@ -29,7 +62,7 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 	if (pg == NULL) {
 	    pg = (void *)UTOP;
 	}
-    ret = sys_ipc_recv(pg);
+    ret = sys_ipc_recv_timeout(pg, *npages, msec);
 //    cprintf("[user] user %08x received value %u at page va 0x%lx from user %08x\n", thisenv->env_id, thisenv->env_ipc_value, pg, thisenv->env_ipc_from);
     if (ret < 0) {
         // store
@@ -39,6 +72,7 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
         if (perm_store) {
             *perm_store = 0;
         }
+        *npages = 0;
 	    return ret;
 	}
 
@@ -49,6 +83,7 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 	if (perm_store) {
 	    *perm_store = thisenv->env_ipc_perm;
 	}
+	*npages = thisenv->env_ipc_npages;
 
     return thisenv->env_ipc_value;
 }
@@ -63,6 +98,14 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
+{
+	ipc_send_pages(to_env, val, pg, 1, perm);
+}
+
+// Like ipc_send, but sends the 'npages' pages starting at 'pg' in one
+// go.  The receiver gets at most as many as it asked for.
+void
+ipc_send_pages(envid_t to_env, uint32_t val, void *pg, size_t npages, int perm)
 {
 	// LAB 4: Your code here.
 	// panic("ipc_send not implemented");
@@ -76,7 +119,7 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 
 	// try indefinitely
 	while (1) {
-	    ret = sys_ipc_try_send(to_env, val, pg, perm);
+	    ret = sys_ipc_try_send_pages(to_env, val, pg, npages, perm);
 	    if (ret < 0) {
 	        if (ret != -E_IPC_NOT_RECV) {
 	            panic("User env %08x ipc try send: %e\n", thisenv->env_id, ret);
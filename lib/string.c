@@ -1,6 +1,8 @@
 // Basic string routines.  Not hardware optimized, but not shabby.
 
 #include <inc/string.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
 
 // Using assembly for memset/memmove
 // makes some difference on real hardware,
@@ -118,23 +120,75 @@ strfind(const char *s, char c)
 }
 
 #if ASM
+// The bulk of each operation is done a word at a time with "rep stosl"
+// or "rep movsl" once the destination is 4-byte aligned; x86 handles
+// the unaligned source loads that may leave.  Short buffers and the
+// head and tail bytes around the aligned bulk go through "rep stosb"
+// or "rep movsb".  Buffers shorter than STRING_BULK_MIN are done
+// byte-wise outright.
+#define STRING_BULK_MIN	16
+
+static inline void
+rep_stosb(void *d, int c, size_t n)
+{
+	asm volatile("cld; rep stosb"
+		     : "+D" (d), "+c" (n) : "a" (c) : "cc", "memory");
+}
+
+static inline void
+rep_stosl(void *d, uint32_t w, size_t n)
+{
+	asm volatile("cld; rep stosl"
+		     : "+D" (d), "+c" (n) : "a" (w) : "cc", "memory");
+}
+
+static inline void
+rep_movsb(void *d, const void *s, size_t n)
+{
+	asm volatile("cld; rep movsb"
+		     : "+D" (d), "+S" (s), "+c" (n) : : "cc", "memory");
+}
+
+static inline void
+rep_movsl(void *d, const void *s, size_t n)
+{
+	asm volatile("cld; rep movsl"
+		     : "+D" (d), "+S" (s), "+c" (n) : : "cc", "memory");
+}
+
+// Copy n units of 'size' bytes backwards; d and s point at the last unit.
+// Some versions of GCC rely on DF being clear, so restore it.
+static inline void
+rep_movsb_back(void *d, const void *s, size_t n)
+{
+	asm volatile("std; rep movsb; cld"
+		     : "+D" (d), "+S" (s), "+c" (n) : : "cc", "memory");
+}
+
+static inline void
+rep_movsl_back(void *d, const void *s, size_t n)
+{
+	asm volatile("std; rep movsl; cld"
+		     : "+D" (d), "+S" (s), "+c" (n) : : "cc", "memory");
+}
+
 void *
 memset(void *v, int c, size_t n)
 {
-	char *p;
-
-	if (n == 0)
-		return v;
-	if ((int)v%4 == 0 && n%4 == 0) {
-		c &= 0xFF;
-		c = (c<<24)|(c<<16)|(c<<8)|c;
-		asm volatile("cld; rep stosl\n"
-			:: "D" (v), "a" (c), "c" (n/4)
-			: "cc", "memory");
-	} else
-		asm volatile("cld; rep stosb\n"
-			:: "D" (v), "a" (c), "c" (n)
-			: "cc", "memory");
+	char *p = v;
+	size_t m;
+
+	c &= 0xFF;
+	if (n >= STRING_BULK_MIN) {
+		m = -(uintptr_t) p & 3;
+		rep_stosb(p, c, m);
+		p += m;
+		n -= m;
+		rep_stosl(p, c * 0x01010101U, n / 4);
+		p += n & ~3;
+		n &= 3;
+	}
+	rep_stosb(p, c, n);
 	return v;
 }
 
@@ -143,31 +197,197 @@ memmove(void *dst, const void *src, size_t n)
 {
 	const char *s;
 	char *d;
+	size_t m;
 
 	s = src;
 	d = dst;
 	if (s < d && s + n > d) {
+		// overlapping with dst above src: copy from the end down
 		s += n;
 		d += n;
-		if ((int)s%4 == 0 && (int)d%4 == 0 && n%4 == 0)
-			asm volatile("std; rep movsl\n"
-				:: "D" (d-4), "S" (s-4), "c" (n/4) : "cc", "memory");
-		else
-			asm volatile("std; rep movsb\n"
-				:: "D" (d-1), "S" (s-1), "c" (n) : "cc", "memory");
-		// Some versions of GCC rely on DF being clear
-		asm volatile("cld" ::: "cc");
+		if (n >= STRING_BULK_MIN) {
+			m = (uintptr_t) d & 3;
+			rep_movsb_back(d - 1, s - 1, m);
+			s -= m;
+			d -= m;
+			n -= m;
+			rep_movsl_back(d - 4, s - 4, n / 4);
+			s -= n & ~3;
+			d -= n & ~3;
+			n &= 3;
+		}
+		rep_movsb_back(d - 1, s - 1, n);
 	} else {
-		if ((int)s%4 == 0 && (int)d%4 == 0 && n%4 == 0)
-			asm volatile("cld; rep movsl\n"
-				:: "D" (d), "S" (s), "c" (n/4) : "cc", "memory");
-		else
-			asm volatile("cld; rep movsb\n"
-				:: "D" (d), "S" (s), "c" (n) : "cc", "memory");
+		if (n >= STRING_BULK_MIN) {
+			m = -(uintptr_t) d & 3;
+			rep_movsb(d, s, m);
+			s += m;
+			d += m;
+			n -= m;
+			rep_movsl(d, s, n / 4);
+			s += n & ~3;
+			d += n & ~3;
+			n &= 3;
+		}
+		rep_movsb(d, s, n);
 	}
 	return dst;
 }
 
+static bool
+cpu_has_sse2(void)
+{
+	static int sse2 = -1;
+	uint32_t edx;
+
+	if (sse2 < 0) {
+		cpuid(1, NULL, NULL, NULL, &edx);
+		sse2 = (edx >> 26) & 1;		// CPUID.01H:EDX.SSE2
+	}
+	return sse2;
+}
+
+// memset for large buffers that will not be read again soon, such as
+// whole pages being cleared.  The 16-byte aligned bulk is written with
+// non-temporal stores (SSE2 movnti), which go around the caches rather
+// than evicting lines worth keeping.  movnti only uses general purpose
+// registers, so this is safe in the kernel too.
+void *
+memset_nt(void *v, int c, size_t n)
+{
+	char *p = v;
+	uint32_t w;
+	size_t m;
+
+	if (n < 64 || !cpu_has_sse2())
+		return memset(v, c, n);
+
+	m = -(uintptr_t) p & 15;
+	memset(p, c, m);
+	p += m;
+	n -= m;
+	w = (c & 0xFF) * 0x01010101U;
+	for (; n >= 16; n -= 16, p += 16)
+		asm volatile("movnti %1,0(%0)\n\t"
+			     "movnti %1,4(%0)\n\t"
+			     "movnti %1,8(%0)\n\t"
+			     "movnti %1,12(%0)"
+			     : : "r" (p), "r" (w) : "memory");
+	// order the weakly-ordered stores before anything that follows
+	asm volatile("sfence" : : : "memory");
+	memset(p, c, n);
+	return v;
+}
+
+// Whole-page operations.  Both pointers must be page aligned (src
+// need only be 4-byte aligned for full speed), so there is no head or
+// tail to deal with and the whole page is one rep stosl/movsl.
+void
+zero_page(void *pg)
+{
+	rep_stosl(pg, 0, PGSIZE / 4);
+}
+
+void
+copy_page(void *dst, const void *src)
+{
+	rep_movsl(dst, src, PGSIZE / 4);
+}
+
+// Cache-bypassing variants, for pages the caller will not read again
+// soon: the stores are movnti, 64 bytes per iteration.
+void
+zero_page_nt(void *pg)
+{
+	char *p, *end;
+
+	if (!cpu_has_sse2()) {
+		zero_page(pg);
+		return;
+	}
+	for (p = pg, end = p + PGSIZE; p < end; p += 64)
+		asm volatile("movnti %1,0(%0)\n\t"
+			     "movnti %1,4(%0)\n\t"
+			     "movnti %1,8(%0)\n\t"
+			     "movnti %1,12(%0)\n\t"
+			     "movnti %1,16(%0)\n\t"
+			     "movnti %1,20(%0)\n\t"
+			     "movnti %1,24(%0)\n\t"
+			     "movnti %1,28(%0)\n\t"
+			     "movnti %1,32(%0)\n\t"
+			     "movnti %1,36(%0)\n\t"
+			     "movnti %1,40(%0)\n\t"
+			     "movnti %1,44(%0)\n\t"
+			     "movnti %1,48(%0)\n\t"
+			     "movnti %1,52(%0)\n\t"
+			     "movnti %1,56(%0)\n\t"
+			     "movnti %1,60(%0)"
+			     : : "r" (p), "r" (0) : "memory");
+	asm volatile("sfence" : : : "memory");
+}
+
+void
+copy_page_nt(void *dst, const void *src)
+{
+	const char *s;
+	char *d, *end;
+	uint32_t a, b;
+
+	if (!cpu_has_sse2()) {
+		copy_page(dst, src);
+		return;
+	}
+	for (d = dst, s = src, end = d + PGSIZE; d < end; d += 16, s += 16)
+		asm volatile("movl 0(%3),%0\n\t"
+			     "movl 4(%3),%1\n\t"
+			     "movnti %0,0(%2)\n\t"
+			     "movnti %1,4(%2)\n\t"
+			     "movl 8(%3),%0\n\t"
+			     "movl 12(%3),%1\n\t"
+			     "movnti %0,8(%2)\n\t"
+			     "movnti %1,12(%2)"
+			     : "=&r" (a), "=&r" (b)
+			     : "r" (d), "r" (s) : "memory");
+	asm volatile("sfence" : : : "memory");
+}
+
+#ifndef JOS_KERNEL
+// memcpy whose bulk moves 64 bytes per iteration through the SSE2
+// registers, with unaligned loads and 16-byte aligned stores.  User
+// environments only: the kernel never touches the XMM registers, and
+// a user environment that does pays for saving them on every context
+// switch from then on (see env_fpu_release), so this is opt-in.
+__attribute__((target("sse2"))) void *
+memcpy_sse2(void *dst, const void *src, size_t n)
+{
+	const char *s = src;
+	char *d = dst;
+	size_t m;
+
+	if (n < 128 || !cpu_has_sse2())
+		return memcpy(dst, src, n);
+
+	m = -(uintptr_t) d & 15;
+	memcpy(d, s, m);
+	s += m;
+	d += m;
+	n -= m;
+	for (; n >= 64; n -= 64, s += 64, d += 64)
+		asm volatile("movdqu 0(%1),%%xmm0\n\t"
+			     "movdqu 16(%1),%%xmm1\n\t"
+			     "movdqu 32(%1),%%xmm2\n\t"
+			     "movdqu 48(%1),%%xmm3\n\t"
+			     "movdqa %%xmm0,0(%0)\n\t"
+			     "movdqa %%xmm1,16(%0)\n\t"
+			     "movdqa %%xmm2,32(%0)\n\t"
+			     "movdqa %%xmm3,48(%0)"
+			     : : "r" (d), "r" (s)
+			     : "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+	memcpy(d, s, n);
+	return dst;
+}
+#endif
+
 #else
 
 void *
@@ -203,6 +423,30 @@ memmove(void *dst, const void *src, size_t n)
 
 	return dst;
 }
+
+void
+zero_page(void *pg)
+{
+	memset(pg, 0, PGSIZE);
+}
+
+void
+copy_page(void *dst, const void *src)
+{
+	memmove(dst, src, PGSIZE);
+}
+
+void
+zero_page_nt(void *pg)
+{
+	zero_page(pg);
+}
+
+void
+copy_page_nt(void *dst, const void *src)
+{
+	copy_page(dst, src);
+}
 #endif
 
 void *
@@ -0,0 +1,131 @@
+// Mutexes, condition variables and barriers for environments that
+// share memory.
+//
+// Each primitive keeps its whole state in user memory and is taken
+// and released with atomic instructions alone; the kernel is entered,
+// through sys_futex_wait and sys_futex_wake, only when an environment
+// actually has to block or has a blocked environment to wake.
+//
+// The mutex is the three-state futex mutex from Drepper's "Futexes Are
+// Tricky": m_state is 0 when free, 1 when held, and 2 when held with
+// (possibly) someone asleep on it, so an uncontended unlock can tell
+// there is nobody to wake.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// Iterations to spin on a held mutex before sleeping: the holder may
+// be running on another CPU and about to let go.
+#define MUTEX_SPIN	100
+
+static inline uint32_t
+atomic_add(volatile uint32_t *addr, uint32_t n)
+{
+	asm volatile("lock; xaddl %0, %1"
+		     : "+r" (n), "+m" (*addr)
+		     : : "cc", "memory");
+	return n;
+}
+
+// Acquire m, leaving it marked contended.  Used once the caller may
+// have to sleep, and after a condition wait, when others may be asleep
+// on m: the state must stay 2 so that the next unlock wakes one.
+static void
+mutex_lock_contended(struct Mutex *m)
+{
+	while (xchg(&m->m_state, 2) != 0)
+		sys_futex_wait(&m->m_state, 2);
+}
+
+void
+mutex_lock(struct Mutex *m)
+{
+	int i;
+
+	if (cmpxchg(&m->m_state, 0, 1) == 0)
+		return;
+	for (i = 0; i < MUTEX_SPIN; i++) {
+		asm volatile("pause");
+		if (m->m_state == 0 && cmpxchg(&m->m_state, 0, 1) == 0)
+			return;
+	}
+	mutex_lock_contended(m);
+}
+
+// Acquire m if it is free.  Returns true if it was acquired.
+bool
+mutex_trylock(struct Mutex *m)
+{
+	return cmpxchg(&m->m_state, 0, 1) == 0;
+}
+
+void
+mutex_unlock(struct Mutex *m)
+{
+	if (xchg(&m->m_state, 0) == 2)
+		sys_futex_wake(&m->m_state, 1);
+}
+
+// Release m, wait for a cond_signal or cond_broadcast on c, and
+// reacquire m.  As with any condition variable, wakeups may be
+// spurious, so callers must recheck their condition in a loop.
+void
+cond_wait(struct Cond *c, struct Mutex *m)
+{
+	uint32_t seq = c->c_seq;
+
+	// A signal between here and the futex wait changes c_seq, so the
+	// wait returns at once instead of missing it.
+	atomic_add(&c->c_waiters, 1);
+	mutex_unlock(m);
+	sys_futex_wait(&c->c_seq, seq);
+	atomic_add(&c->c_waiters, -1);
+	mutex_lock_contended(m);
+}
+
+// Wake one environment waiting on c, if any.
+void
+cond_signal(struct Cond *c)
+{
+	atomic_add(&c->c_seq, 1);
+	if (c->c_waiters)
+		sys_futex_wake(&c->c_seq, 1);
+}
+
+// Wake every environment waiting on c.
+void
+cond_broadcast(struct Cond *c)
+{
+	atomic_add(&c->c_seq, 1);
+	if (c->c_waiters)
+		sys_futex_wake(&c->c_seq, ~0U);
+}
+
+// Set b up for 'count' environments.  Not safe while any are waiting.
+void
+barrier_init(struct Barrier *b, uint32_t count)
+{
+	b->b_count = count;
+	b->b_arrived = 0;
+	b->b_round = 0;
+}
+
+// Wait until b_count environments have called barrier_wait on b.
+// Returns true in exactly one of them, the last to arrive, which can
+// then do any serial work between phases.  The barrier resets itself
+// for the next round.
+bool
+barrier_wait(struct Barrier *b)
+{
+	uint32_t round = b->b_round;
+
+	if (atomic_add(&b->b_arrived, 1) + 1 == b->b_count) {
+		b->b_arrived = 0;
+		atomic_add(&b->b_round, 1);
+		sys_futex_wake(&b->b_round, ~0U);
+		return 1;
+	}
+	while (b->b_round == round)
+		sys_futex_wait(&b->b_round, round);
+	return 0;
+}
@@ -102,12 +102,63 @@ sys_env_set_pgfault_upcall(envid_t envid, void *upcall)
 int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 {
-	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 1);
+}
+
+int
+sys_ipc_try_send_pages(envid_t envid, uint32_t value, void *srcva,
+		       size_t npages, int perm)
+{
+	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, npages);
 }
 
 int
 sys_ipc_recv(void *dstva)
 {
-	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 1, 0, 0, 0);
+}
+
+int
+sys_ipc_recv_pages(void *dstva, size_t npages)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, npages, 0, 0, 0);
+}
+
+int
+sys_ipc_recv_timeout(void *dstva, size_t npages, unsigned msec)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, npages, msec, 0, 0);
+}
+
+int
+sys_sleep(unsigned msec)
+{
+	return syscall(SYS_sleep, 0, msec, 0, 0, 0, 0);
+}
+
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t expected)
+{
+	return syscall(SYS_futex_wait, 1, (uint32_t) addr, expected, 0, 0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, uint32_t n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
+envid_t
+sys_thread_create(void *eip, void *esp, uintptr_t xstacktop,
+		  volatile uint32_t *exit_futex)
+{
+	return syscall(SYS_thread_create, 0, (uint32_t) eip, (uint32_t) esp,
+		       xstacktop, (uint32_t) exit_futex, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, cpumask, 0, 0, 0);
 }
 
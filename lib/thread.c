@@ -0,0 +1,124 @@
+// Threads: environments sharing one address space.
+//
+// thread_create starts fn(arg) in a new environment that shares this
+// one's page directory (see sys_thread_create), so threads see each
+// other's memory directly, without copy-on-write or IPC.  Each thread
+// runs on its own stack and exception stack in a slot at UTHREADS
+// (see inc/lib.h), which also holds its thisenv.
+//
+// Every thread is an environment of its own: exit() or thread_exit()
+// ends only the calling thread, and the program ends when its last
+// thread does.  Use the primitives in lib/sync.c to synchronize.
+// A thread's slot is reused only once it has been joined.
+
+#include <inc/lib.h>
+
+struct ThreadSlot {
+	envid_t ts_id;			// 0 if the slot is free
+	volatile uint32_t ts_alive;	// cleared by the kernel on exit
+};
+
+static struct ThreadSlot thread_slots[THREAD_MAX];
+static struct Mutex thread_lock;
+
+static void
+thread_start(void (*fn)(void *), void *arg)
+{
+	thisenv = &envs[ENVX(sys_getenvid())];
+	fn(arg);
+	thread_exit();
+}
+
+static void
+thread_unmap(uintptr_t slot)
+{
+	uintptr_t va;
+
+	for (va = slot + PGSIZE; va < THREAD_STACKTOP(slot); va += PGSIZE)
+		sys_page_unmap(0, (void *) va);
+	sys_page_unmap(0, (void *) (THREAD_XSTACKTOP(slot) - PGSIZE));
+}
+
+// Start a thread running fn(arg).  Returns its envid, or < 0 on error:
+//	-E_NO_FREE_ENV if all THREAD_MAX slots (or all environments)
+//		are in use.
+//	-E_NO_MEM if its stacks could not be allocated.
+envid_t
+thread_create(void (*fn)(void *), void *arg)
+{
+	struct ThreadSlot *s;
+	uintptr_t slot, va;
+	uint32_t *sp;
+	envid_t id;
+	int r;
+
+	mutex_lock(&thread_lock);
+	for (s = thread_slots; s < thread_slots + THREAD_MAX; s++)
+		if (s->ts_id == 0)
+			break;
+	if (s < thread_slots + THREAD_MAX)
+		s->ts_id = -1;
+	mutex_unlock(&thread_lock);
+	if (s == thread_slots + THREAD_MAX)
+		return -E_NO_FREE_ENV;
+
+	slot = UTHREADS + (s - thread_slots) * THREAD_SLOT;
+	for (va = slot + PGSIZE; va < THREAD_STACKTOP(slot); va += PGSIZE)
+		if ((r = sys_page_alloc(0, (void *) va, PTE_P | PTE_U | PTE_W)) < 0)
+			goto fail;
+	if ((r = sys_page_alloc(0, (void *) (THREAD_XSTACKTOP(slot) - PGSIZE),
+				PTE_P | PTE_U | PTE_W)) < 0)
+		goto fail;
+
+	// The top word is thisenv, set by the thread itself.  Below it,
+	// thread_start's arguments and a null return address.
+	sp = (uint32_t *) THREAD_STACKTOP(slot);
+	*--sp = 0;
+	*--sp = (uint32_t) arg;
+	*--sp = (uint32_t) fn;
+	*--sp = 0;
+
+	s->ts_alive = 1;
+	if ((r = id = sys_thread_create(thread_start, sp,
+					THREAD_XSTACKTOP(slot),
+					&s->ts_alive)) < 0) {
+		s->ts_alive = 0;
+		goto fail;
+	}
+	s->ts_id = id;
+	return id;
+
+fail:
+	thread_unmap(slot);
+	s->ts_id = 0;
+	return r;
+}
+
+// Wait for thread id to exit, then free its stacks.
+// Returns 0 on success, -E_BAD_ENV if id is not an unjoined thread.
+int
+thread_join(envid_t id)
+{
+	struct ThreadSlot *s;
+	uint32_t alive;
+
+	for (s = thread_slots; s < thread_slots + THREAD_MAX; s++)
+		if (s->ts_id == id)
+			break;
+	if (id <= 0 || s == thread_slots + THREAD_MAX)
+		return -E_BAD_ENV;
+
+	while ((alive = s->ts_alive) != 0)
+		sys_futex_wait(&s->ts_alive, alive);
+	thread_unmap(UTHREADS + (s - thread_slots) * THREAD_SLOT);
+	s->ts_id = 0;
+	return 0;
+}
+
+// End the calling thread.
+void
+thread_exit(void)
+{
+	exit();
+	panic("thread_exit: still running");
+}
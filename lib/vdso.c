@@ -0,0 +1,52 @@
+// Queries answered from the read-only info pages at UVDSO (see
+// inc/vdso.h), without entering the kernel.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define vdso_time	((const struct VdsoTime *) UVDSO)
+#define vdso_env	((const struct VdsoEnv *) (UVDSO + PGSIZE))
+
+// The envid of the calling environment.  In a program with several
+// threads the page is shared, so threads must use sys_getenvid().
+envid_t
+vdso_envid(void)
+{
+	return vdso_env->ve_envid;
+}
+
+// The CPU the calling environment was last scheduled on.  It may have
+// moved since, as with any answer to this question.
+int
+vdso_cpunum(void)
+{
+	return vdso_env->ve_cpunum;
+}
+
+// Nanoseconds since the machine was reset, as the kernel's time_ns().
+uint64_t
+vdso_time_ns(void)
+{
+	uint64_t cycles = read_tsc();
+	uint32_t hi = cycles >> 32, lo = cycles;
+	uint32_t mult = vdso_time->vt_tsc_ns_mult;
+	uint32_t shift = vdso_time->vt_tsc_ns_shift;
+
+	return (((uint64_t) hi * mult) << (32 - shift))
+		+ (((uint64_t) lo * mult) >> shift);
+}
+
+// Timer interrupts taken by the boot CPU since boot.
+uint64_t
+vdso_ticks(void)
+{
+	const volatile uint32_t *t = (const volatile uint32_t *) &vdso_time->vt_ticks;
+	uint32_t hi, lo;
+
+	// The kernel may bump the count between our two loads
+	do {
+		hi = t[1];
+		lo = t[0];
+	} while (t[1] != hi);
+	return ((uint64_t) hi << 32) | lo;
+}
@@ -0,0 +1,26 @@
+// Pin ourselves to each CPU in turn with sys_env_set_affinity and
+// check that we only ever run there, then show the migration count.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	int cpu, i, r;
+
+	for (cpu = 0; cpu < 8; cpu++) {
+		if ((r = sys_env_set_affinity(0, 1 << cpu)) < 0)
+			break;
+		for (i = 0; i < 20; i++) {
+			if (ENVSCHED(thisenv)->env_cpunum != cpu)
+				panic("pinned to CPU %d but running on CPU %d",
+				      cpu, ENVSCHED(thisenv)->env_cpunum);
+			sys_yield();
+		}
+		cprintf("pinned to CPU %d: ok, %u migrations so far\n",
+			cpu, ENVSCHED(thisenv)->env_migrations);
+	}
+	if (cpu == 0)
+		panic("sys_env_set_affinity: %e", r);
+	sys_env_set_affinity(0, ENV_AFFINITY_ALL);
+}
@@ -0,0 +1,79 @@
+// Time lib/fiber.c: creating fibers and switching between them, and
+// an IPC echo server that gives each client conversation a fiber.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NWORKERS	4
+#define NFIBERS		1000
+#define NYIELDS		20
+#define NCLIENTS	16
+#define NROUNDS		100
+
+static void
+yielder(void *arg)
+{
+	int i;
+
+	for (i = 0; i < NYIELDS; i++)
+		fiber_yield();
+}
+
+static void
+echo(void *arg)
+{
+	envid_t client = (envid_t) arg;
+	int i;
+
+	for (i = 0; i < NROUNDS; i++)
+		fiber_ipc_send(client, fiber_ipc_recv(client) + 1);
+}
+
+static void
+client(envid_t server)
+{
+	uint32_t v = 0;
+	int i;
+
+	for (i = 0; i < NROUNDS; i++) {
+		ipc_send(server, v, 0, 0);
+		if (ipc_recv(0, 0, 0) != v + 1)
+			panic("bad echo");
+		v++;
+	}
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t server = thisenv->env_id, ids[NCLIENTS];
+	uint64_t start, create, run;
+	int i, r;
+
+	start = read_tsc();
+	for (i = 0; i < NFIBERS; i++)
+		if ((r = fiber_create(yielder, 0)) < 0)
+			panic("fiber_create: %e", r);
+	create = read_tsc() - start;
+	start = read_tsc();
+	fiber_run(NWORKERS);
+	run = read_tsc() - start;
+	cprintf("%d fibers: %llu cycles per create, %llu per switch\n",
+		NFIBERS, create / NFIBERS, run / (NFIBERS * (NYIELDS + 1)));
+
+	for (i = 0; i < NCLIENTS; i++) {
+		if ((ids[i] = fork()) < 0)
+			panic("fork: %e", ids[i]);
+		if (ids[i] == 0)
+			client(server);
+	}
+	start = read_tsc();
+	for (i = 0; i < NCLIENTS; i++)
+		if ((r = fiber_create(echo, (void *) ids[i])) < 0)
+			panic("fiber_create: %e", r);
+	fiber_run(NWORKERS);
+	cprintf("%d clients x %d echoes: %llu cycles per round trip\n",
+		NCLIENTS, NROUNDS,
+		(read_tsc() - start) / (NCLIENTS * NROUNDS));
+}
@@ -0,0 +1,77 @@
+// Exercise the futex-based mutex, condition variable and barrier
+// (lib/sync.c) across environments sharing a PTE_SHARE page.
+//
+// NCHILD children each add to a shared counter under the mutex,
+// meet at a barrier, and check each other's totals; the parent
+// sleeps on a condition variable until they have all finished.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCHILD	4
+#define ITERS	10000
+
+struct Shared {
+	struct Mutex mutex;
+	struct Cond cond;
+	struct Barrier barrier;
+	uint32_t counter;
+	uint32_t done;
+	uint32_t errors;
+};
+
+static struct Shared *shared = (struct Shared *) 0xD0000000;
+
+static void
+child(void)
+{
+	int i;
+
+	for (i = 0; i < ITERS; i++) {
+		mutex_lock(&shared->mutex);
+		shared->counter++;
+		mutex_unlock(&shared->mutex);
+	}
+
+	// Nobody passes the barrier before everyone has finished counting
+	barrier_wait(&shared->barrier);
+	mutex_lock(&shared->mutex);
+	if (shared->counter != NCHILD * ITERS)
+		shared->errors++;
+	shared->done++;
+	cond_signal(&shared->cond);
+	mutex_unlock(&shared->mutex);
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	envid_t id;
+	int i, r;
+
+	if ((r = sys_page_alloc(0, shared, PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	barrier_init(&shared->barrier, NCHILD);
+
+	start = read_tsc();
+	for (i = 0; i < NCHILD; i++) {
+		if ((id = fork()) < 0)
+			panic("fork: %e", id);
+		if (id == 0)
+			child();
+	}
+
+	mutex_lock(&shared->mutex);
+	while (shared->done < NCHILD)
+		cond_wait(&shared->cond, &shared->mutex);
+	mutex_unlock(&shared->mutex);
+
+	cprintf("futex: %d envs x %d increments = %u in %llu cycles\n",
+		NCHILD, ITERS, shared->counter, read_tsc() - start);
+	if (shared->counter != NCHILD * ITERS || shared->errors)
+		panic("futex: counter %u, %u errors", shared->counter,
+		      shared->errors);
+	cprintf("futex: OK\n");
+}
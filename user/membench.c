@@ -0,0 +1,149 @@
+// Compare the bulk memory routines in lib/string.c against the
+// original byte-or-word rep-string versions.
+// Prints the average cycle count per call and per byte for a range
+// of sizes, both word-aligned and misaligned by one byte.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define MAXSZ	65536
+#define ROUNDS	64
+
+static char srcbuf[MAXSZ + 64] __attribute__((aligned(PGSIZE)));
+static char dstbuf[MAXSZ + 64] __attribute__((aligned(PGSIZE)));
+
+// The routines below are the pre-alignment-dispatch versions:
+// anything not a multiple of 4 in both address and length falls back
+// to rep stosb/movsb for the whole buffer.
+static void *
+old_memset(void *v, int c, size_t n)
+{
+	void *p = v;
+
+	if (n == 0)
+		return v;
+	if ((int)v%4 == 0 && n%4 == 0) {
+		c &= 0xFF;
+		c = (c<<24)|(c<<16)|(c<<8)|c;
+		n /= 4;
+		asm volatile("cld; rep stosl\n"
+			: "+D" (p), "+c" (n)
+			: "a" (c)
+			: "cc", "memory");
+	} else
+		asm volatile("cld; rep stosb\n"
+			: "+D" (p), "+c" (n)
+			: "a" (c)
+			: "cc", "memory");
+	return v;
+}
+
+static void *
+old_memcpy(void *dst, const void *src, size_t n)
+{
+	void *d = dst;
+
+	if ((int)src%4 == 0 && (int)dst%4 == 0 && n%4 == 0) {
+		n /= 4;
+		asm volatile("cld; rep movsl\n"
+			: "+D" (d), "+S" (src), "+c" (n) : : "cc", "memory");
+	} else
+		asm volatile("cld; rep movsb\n"
+			: "+D" (d), "+S" (src), "+c" (n) : : "cc", "memory");
+	return dst;
+}
+
+enum { OP_SET, OP_SET_NT, OP_COPY, OP_COPY_SSE2,
+       OP_ZERO_PAGE, OP_ZERO_PAGE_NT, OP_COPY_PAGE, OP_COPY_PAGE_NT };
+
+static uint64_t
+run(int op, int old, size_t off, size_t n)
+{
+	uint64_t start, best = ~0ULL;
+	int i;
+
+	for (i = 0; i < ROUNDS; i++) {
+		start = read_tsc();
+		switch (op) {
+		case OP_SET:
+			if (old)
+				old_memset(dstbuf + off, i, n);
+			else
+				memset(dstbuf + off, i, n);
+			break;
+		case OP_SET_NT:
+			memset_nt(dstbuf + off, i, n);
+			break;
+		case OP_COPY:
+			if (old)
+				old_memcpy(dstbuf + off, srcbuf + off, n);
+			else
+				memcpy(dstbuf + off, srcbuf + off, n);
+			break;
+		case OP_COPY_SSE2:
+			memcpy_sse2(dstbuf + off, srcbuf + off, n);
+			break;
+		case OP_ZERO_PAGE:
+			zero_page(dstbuf);
+			break;
+		case OP_ZERO_PAGE_NT:
+			zero_page_nt(dstbuf);
+			break;
+		case OP_COPY_PAGE:
+			copy_page(dstbuf, srcbuf);
+			break;
+		case OP_COPY_PAGE_NT:
+			copy_page_nt(dstbuf, srcbuf);
+			break;
+		}
+		start = read_tsc() - start;
+		if (start < best)
+			best = start;
+	}
+	return best;
+}
+
+static void
+report(const char *name, int op, int old)
+{
+	static const size_t sizes[] = { 64, 1024, 4096, MAXSZ };
+	uint64_t c;
+	size_t n;
+	int i, off;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		for (off = 0; off <= 1; off++) {
+			n = sizes[i] - off;
+			c = run(op, old, off, n);
+			cprintf("%-12s %6u %s %8llu cycles %3u.%02u cyc/B\n",
+				name, n, off ? "unaligned" : "aligned  ", c,
+				(unsigned) (c / n),
+				(unsigned) ((c * 100 / n) % 100));
+		}
+}
+
+static void
+report_page(const char *name, int op)
+{
+	uint64_t c = run(op, 0, 0, PGSIZE);
+
+	cprintf("%-12s %6u page      %8llu cycles\n", name, PGSIZE, c);
+}
+
+void
+umain(int argc, char **argv)
+{
+	memset(srcbuf, 0x5a, sizeof(srcbuf));
+	memset(dstbuf, 0, sizeof(dstbuf));
+
+	report("old memset", OP_SET, 1);
+	report("memset", OP_SET, 0);
+	report("memset_nt", OP_SET_NT, 0);
+	report("old memcpy", OP_COPY, 1);
+	report("memcpy", OP_COPY, 0);
+	report("memcpy_sse2", OP_COPY_SSE2, 0);
+	report_page("zero_page", OP_ZERO_PAGE);
+	report_page("zero_page_nt", OP_ZERO_PAGE_NT);
+	report_page("copy_page", OP_COPY_PAGE);
+	report_page("copy_page_nt", OP_COPY_PAGE_NT);
+}
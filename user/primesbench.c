@@ -0,0 +1,134 @@
+// Time the concurrent prime sieve (see user/primes.c) with its
+// integers passed by ipc_send/ipc_recv, one system call and usually
+// one context switch each, against the same pipeline built from
+// shared-memory channels (lib/chan.c).
+//
+// The generator feeds 2..NUMS followed by a 0, which each stage
+// passes on before exiting; the last stage reports back to the
+// generator, which prints the elapsed cycles.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NUMS	2000		// 303 primes, so 303 stages
+
+// Where each stage maps its input and output channel pages.
+#define CHAN_IN		((void *) 0xD0000000)
+#define CHAN_OUT	((void *) (0xD0000000 + PGSIZE))
+
+static envid_t generator;
+
+static void
+stage_done(void)
+{
+	ipc_send(generator, 0, 0, 0);
+	exit();
+}
+
+static void
+ipc_stage(void)
+{
+	int32_t i, p;
+	envid_t id;
+
+top:
+	if ((p = ipc_recv(0, 0, 0)) == 0)
+		stage_done();
+	if ((id = fork()) < 0)
+		panic("fork: %e", id);
+	if (id == 0)
+		goto top;
+
+	while ((i = ipc_recv(0, 0, 0)) != 0)
+		if (i % p)
+			ipc_send(id, i, 0, 0);
+	ipc_send(id, 0, 0, 0);
+	exit();
+}
+
+static void
+chan_stage(void)
+{
+	struct Chan *in, *out;
+	int32_t buf[64];
+	int32_t p;
+	ssize_t n;
+	envid_t id;
+	int i, r;
+
+top:
+	if ((r = chan_accept(CHAN_IN, &in)) < 0)
+		panic("chan_accept: %e", r);
+	if (chan_read(in, &p, sizeof(p)) != sizeof(p) || p == 0)
+		stage_done();
+	if ((id = fork()) < 0)
+		panic("fork: %e", id);
+	if (id == 0)
+		goto top;
+	if ((r = chan_create(id, CHAN_OUT, &out)) < 0)
+		panic("chan_create: %e", r);
+
+	// Take whatever the ring holds in one go; the writer only ever
+	// writes whole integers.
+	while ((n = chan_read(in, buf, sizeof(buf))) > 0)
+		for (i = 0; i < n / sizeof(buf[0]); i++) {
+			if (buf[i] == 0)
+				goto done;
+			if (buf[i] % p)
+				chan_write(out, &buf[i], sizeof(buf[i]));
+		}
+done:
+	p = 0;
+	chan_write(out, &p, sizeof(p));
+	chan_close(out);
+	exit();
+}
+
+static uint64_t
+run(bool use_chan)
+{
+	struct Chan *out;
+	uint64_t start;
+	envid_t id;
+	int32_t i;
+	int r;
+
+	start = read_tsc();
+	if ((id = fork()) < 0)
+		panic("fork: %e", id);
+	if (id == 0) {
+		if (use_chan)
+			chan_stage();
+		else
+			ipc_stage();
+		exit();
+	}
+
+	if (use_chan) {
+		if ((r = chan_create(id, CHAN_OUT, &out)) < 0)
+			panic("chan_create: %e", r);
+		for (i = 2; i <= NUMS; i++)
+			chan_write(out, &i, sizeof(i));
+		i = 0;
+		chan_write(out, &i, sizeof(i));
+		chan_close(out);
+		sys_page_unmap(0, CHAN_OUT);
+	} else {
+		for (i = 2; i <= NUMS; i++)
+			ipc_send(id, i, 0, 0);
+		ipc_send(id, 0, 0, 0);
+	}
+
+	// wait for the last stage
+	ipc_recv(0, 0, 0);
+	return read_tsc() - start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	generator = thisenv->env_id;
+
+	cprintf("primes to %d via ipc:      %llu cycles\n", NUMS, run(0));
+	cprintf("primes to %d via channels: %llu cycles\n", NUMS, run(1));
+}
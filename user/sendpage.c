@@ -1,7 +1,11 @@
 // Test Conversation between parent and child environment
 // Contributed by Varun Agrawal at Stony Brook
+//
+// Then measure IPC page throughput: a 1 MiB buffer sent one page per
+// ipc_send, and the same buffer sent in a single ipc_send_pages.
 
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 const char *str1 = "hello child environment! how are you?";
 const char *str2 = "hello parent environment! I'm good.";
@@ -9,6 +13,58 @@ const char *str2 = "hello parent environment! I'm good.";
 #define TEMP_ADDR	((char*)0xa00000)
 #define TEMP_ADDR_CHILD	((char*)0xb00000)
 
+#define BENCH_NPAGES	256	// 1 MiB
+#define BENCH_ADDR	((char*)0x10000000)
+#define BENCH_ADDR_CHILD ((char*)0x20000000)
+
+static void
+bench_child(envid_t parent)
+{
+	envid_t who;
+	size_t i, n;
+	int bad = 0;
+
+	for (i = 0; i < BENCH_NPAGES; i++)
+		ipc_recv(&who, BENCH_ADDR_CHILD + i * PGSIZE, 0);
+	ipc_send(parent, 0, 0, 0);
+
+	n = BENCH_NPAGES;
+	ipc_recv_pages(&who, BENCH_ADDR_CHILD, &n, 0);
+	for (i = 0; i < BENCH_NPAGES; i++)
+		if (*(uint32_t *) (BENCH_ADDR_CHILD + i * PGSIZE) != i)
+			bad++;
+	ipc_send(parent, n == BENCH_NPAGES && !bad, 0, 0);
+}
+
+static void
+bench_parent(envid_t child)
+{
+	uint64_t start, one, bulk;
+	size_t i;
+	int ok;
+
+	for (i = 0; i < BENCH_NPAGES; i++) {
+		sys_page_alloc(0, BENCH_ADDR + i * PGSIZE, PTE_P | PTE_W | PTE_U);
+		*(uint32_t *) (BENCH_ADDR + i * PGSIZE) = i;
+	}
+
+	start = read_tsc();
+	for (i = 0; i < BENCH_NPAGES; i++)
+		ipc_send(child, 0, BENCH_ADDR + i * PGSIZE, PTE_P | PTE_U);
+	ipc_recv(0, 0, 0);
+	one = read_tsc() - start;
+
+	start = read_tsc();
+	ipc_send_pages(child, 0, BENCH_ADDR, BENCH_NPAGES, PTE_P | PTE_U);
+	ok = ipc_recv(0, 0, 0);
+	bulk = read_tsc() - start;
+
+	cprintf("sendpage: %d pages one per send: %llu cycles\n",
+		BENCH_NPAGES, one);
+	cprintf("sendpage: %d pages in one send:  %llu cycles%s\n",
+		BENCH_NPAGES, bulk, ok ? "" : " (data mismatch!)");
+}
+
 void
 umain(int argc, char **argv)
 {
@@ -23,6 +79,7 @@ umain(int argc, char **argv)
 
 		memcpy(TEMP_ADDR_CHILD, str2, strlen(str2) + 1);
 		ipc_send(who, 0, TEMP_ADDR_CHILD, PTE_P | PTE_W | PTE_U);
+		bench_child(who);
 		return;
 	}
 
@@ -35,5 +92,6 @@ umain(int argc, char **argv)
 	cprintf("%x got message: %s\n", who, TEMP_ADDR);
 	if (strncmp(TEMP_ADDR, str2, strlen(str2)) == 0)
 		cprintf("parent received correct message\n");
+	bench_parent(who);
 	return;
 }
@@ -0,0 +1,62 @@
+// Check sys_sleep and ipc_recv_timeout, and show that a sleeping
+// environment leaves its CPU to others: a spinning child gets about
+// as much done while the parent sleeps as when it runs alone, and
+// much less while the parent waits by calling sys_yield in a loop.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define WAIT_MS	200
+
+static volatile uint32_t *counter = (uint32_t *) 0xD0000000;
+
+// Wait WAIT_MS by polling the TSC around sys_yield.
+static void
+yield_wait(uint64_t cycles)
+{
+	uint64_t start = read_tsc();
+
+	while (read_tsc() - start < cycles)
+		sys_yield();
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start, cycles_per_ms;
+	uint32_t before, asleep, yielding;
+	envid_t child, from;
+	int32_t r;
+
+	// Calibrate the TSC against sys_sleep itself
+	start = read_tsc();
+	sys_sleep(WAIT_MS);
+	cycles_per_ms = (read_tsc() - start) / WAIT_MS;
+	cprintf("sleep %d ms: %llu cycles\n", WAIT_MS, cycles_per_ms * WAIT_MS);
+
+	start = read_tsc();
+	r = ipc_recv_timeout(&from, 0, 0, WAIT_MS);
+	cprintf("ipc_recv_timeout %d ms: %e after %llu cycles\n", WAIT_MS, r,
+		read_tsc() - start);
+
+	if ((r = sys_page_alloc(0, (void *) counter,
+				PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0)
+		while (1)
+			(*counter)++;
+
+	before = *counter;
+	sys_sleep(WAIT_MS);
+	asleep = *counter - before;
+
+	before = *counter;
+	yield_wait(cycles_per_ms * WAIT_MS);
+	yielding = *counter - before;
+
+	cprintf("child progress while parent sleeps: %u, yields: %u\n",
+		asleep, yielding);
+	sys_env_destroy(child);
+}
@@ -24,7 +24,7 @@ umain(int argc, char **argv)
 	}
 
 	// Wait for the parent to finish forking
-	while (envs[ENVX(parent)].env_status != ENV_FREE)
+	while (envsched[ENVX(parent)].env_status != ENV_FREE)
 		asm volatile("pause");
 	cprintf("I am child %08x, parent has exited...\n", thisenv->env_id);
 
@@ -39,7 +39,7 @@ umain(int argc, char **argv)
 		panic("ran on two CPUs at once (counter is %d)", counter);
 
 	// Check that we see environments running on different CPUs
-	cprintf("[%08x] stresssched on CPU %d\n", thisenv->env_id, thisenv->env_cpunum);
+	cprintf("[%08x] stresssched on CPU %d\n", thisenv->env_id, ENVSCHED(thisenv)->env_cpunum);
 
 }
 
@@ -0,0 +1,74 @@
+// Count the primes below LIMIT by trial division, first in the main
+// thread alone and then split across NTHREAD threads sharing the
+// address space (lib/thread.c), and report the cycles each took.
+// The threads add their counts into one total under a mutex.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define LIMIT	200000
+#define NTHREAD	4
+
+static struct Mutex total_lock;
+static uint32_t total;
+static uint32_t nthread;
+
+static bool
+is_prime(uint32_t n)
+{
+	uint32_t d;
+
+	if (n < 2)
+		return 0;
+	for (d = 2; d * d <= n; d++)
+		if (n % d == 0)
+			return 0;
+	return 1;
+}
+
+// Count every nthread'th number starting at (uintptr_t) arg, so that
+// each thread gets a similar mix of small and large numbers.
+static void
+count(void *arg)
+{
+	uint32_t n, found = 0;
+
+	for (n = (uintptr_t) arg; n < LIMIT; n += nthread)
+		found += is_prime(n);
+
+	mutex_lock(&total_lock);
+	total += found;
+	mutex_unlock(&total_lock);
+}
+
+static uint64_t
+run(uint32_t n)
+{
+	envid_t ids[NTHREAD];
+	uint64_t start;
+	uint32_t i;
+
+	total = 0;
+	nthread = n;
+	start = read_tsc();
+	for (i = 1; i < n; i++)
+		if ((ids[i] = thread_create(count, (void *) i)) < 0)
+			panic("thread_create: %e", ids[i]);
+	count((void *) 0);
+	for (i = 1; i < n; i++)
+		thread_join(ids[i]);
+	return read_tsc() - start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t c;
+	uint32_t n;
+
+	for (n = 1; n <= NTHREAD; n *= 2) {
+		c = run(n);
+		cprintf("%d thread(s): %u primes below %d in %llu cycles\n",
+			n, total, LIMIT, c);
+	}
+}
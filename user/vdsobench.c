@@ -0,0 +1,52 @@
+// Compare asking the kernel who we are with reading the info pages at
+// UVDSO, and check that the two agree, in a parent and a forked child.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define ROUNDS	10000
+
+static void
+check(const char *who)
+{
+	uint64_t start, sys_cycles, vdso_cycles;
+	envid_t id = 0;
+	int i;
+
+	if (vdso_envid() != sys_getenvid())
+		panic("%s: vdso envid %08x, sys_getenvid %08x",
+		      who, vdso_envid(), sys_getenvid());
+
+	start = read_tsc();
+	for (i = 0; i < ROUNDS; i++)
+		id |= sys_getenvid();
+	sys_cycles = read_tsc() - start;
+
+	start = read_tsc();
+	for (i = 0; i < ROUNDS; i++)
+		id |= vdso_envid();
+	vdso_cycles = read_tsc() - start;
+	USED(id);
+
+	cprintf("%s %08x on CPU %d: sys_getenvid %llu cycles, vdso_envid %llu cycles\n",
+		who, vdso_envid(), vdso_cpunum(),
+		sys_cycles / ROUNDS, vdso_cycles / ROUNDS);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t ns = vdso_time_ns(), ticks = vdso_ticks();
+	envid_t child;
+
+	check("parent");
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		check("child");
+		return;
+	}
+	sys_sleep(100);
+	cprintf("100 ms sleep: %llu ns, %llu ticks by vdso\n",
+		vdso_time_ns() - ns, vdso_ticks() - ticks);
+}
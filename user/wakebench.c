@@ -0,0 +1,38 @@
+// Measure IPC wakeup latency across CPUs.
+// Two environments bounce a counter back and forth, as in
+// user/pingpong, and the parent times each round trip with the TSC.
+// Run with CPUS=2 or more: each side blocks in ipc_recv while the
+// other runs, so its CPU idles, and every message has to wake it.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define ROUNDS	1000
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start, t, total = 0, min = ~0ULL, max = 0;
+	envid_t who;
+	uint32_t i;
+
+	if ((who = fork()) == 0) {
+		while ((i = ipc_recv(&who, 0, 0)) < ROUNDS)
+			ipc_send(who, i, 0, 0);
+		return;
+	}
+
+	for (i = 0; i < ROUNDS; i++) {
+		start = read_tsc();
+		ipc_send(who, i, 0, 0);
+		ipc_recv(0, 0, 0);
+		t = read_tsc() - start;
+		total += t;
+		min = MIN(min, t);
+		max = MAX(max, t);
+	}
+	ipc_send(who, ROUNDS, 0, 0);
+
+	cprintf("wakebench: %d round trips: min %llu avg %llu max %llu cycles\n",
+		ROUNDS, min, total / ROUNDS, max);
+}